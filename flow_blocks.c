@@ -99,3 +99,125 @@ generate_ipv4_flow(uint16_t port_id, uint16_t rx_q,
 	return flow;
 }
 
+
+/* rte_flow priorities: steering rules win over MARK rules of the same flow */
+#define FLOW_PRIO_STEER		0
+#define FLOW_PRIO_MARK		1
+
+/**
+ * create a flow rule for one IPv4 TCP or UDP flow of untagged frames:
+ * send its packets to a queue and, if mark is set, mark them.
+ *
+ * @param port_id
+ *   The selected port.
+ * @param rx_q
+ *   The selected target queue.
+ * @param key
+ *   The flow: addresses, ports and protocol.
+ * @param mark
+ *   Mark the packets with mark_id, in mbuf hash.fdir.hi.
+ * @param mark_id
+ *   The id to mark with.
+ * @param priority
+ *   The rule priority, FLOW_PRIO_*.
+ * @param[out] error
+ *   Perform verbose error reporting if not NULL.
+ *
+ * @return
+ *   A flow if the rule could be created else return NULL.
+ */
+static struct rte_flow *
+generate_5tuple_flow(uint16_t port_id, uint16_t rx_q,
+		const union rte_table_netflow_key *key, int mark, uint32_t mark_id,
+		uint32_t priority, struct rte_flow_error *error)
+{
+	struct rte_flow_attr attr;
+	struct rte_flow_item pattern[MAX_PATTERN_NUM + 1];
+	struct rte_flow_action action[MAX_ACTION_NUM + 1];
+	struct rte_flow *flow = NULL;
+	struct rte_flow_action_queue queue = { .index = rx_q };
+	struct rte_flow_action_mark mark_conf = { .id = mark_id };
+	struct rte_flow_item_ipv4 ip_spec, ip_mask;
+	struct rte_flow_item_tcp tcp_spec, tcp_mask;
+	struct rte_flow_item_udp udp_spec, udp_mask;
+	int res, a = 0;
+
+	memset(pattern, 0, sizeof(pattern));
+	memset(action, 0, sizeof(action));
+	memset(&attr, 0, sizeof(struct rte_flow_attr));
+	attr.ingress = 1;
+	attr.priority = priority;
+
+	if (mark) {
+		action[a].type = RTE_FLOW_ACTION_TYPE_MARK;
+		action[a++].conf = &mark_conf;
+	}
+	action[a].type = RTE_FLOW_ACTION_TYPE_QUEUE;
+	action[a++].conf = &queue;
+	action[a].type = RTE_FLOW_ACTION_TYPE_END;
+
+	pattern[0].type = RTE_FLOW_ITEM_TYPE_ETH;
+
+	memset(&ip_spec, 0, sizeof(struct rte_flow_item_ipv4));
+	memset(&ip_mask, 0, sizeof(struct rte_flow_item_ipv4));
+	ip_spec.hdr.src_addr = key->ip_src;
+	ip_mask.hdr.src_addr = FULL_MASK;
+	ip_spec.hdr.dst_addr = key->ip_dst;
+	ip_mask.hdr.dst_addr = FULL_MASK;
+	ip_spec.hdr.next_proto_id = key->proto;
+	ip_mask.hdr.next_proto_id = 0xff;
+	pattern[1].type = RTE_FLOW_ITEM_TYPE_IPV4;
+	pattern[1].spec = &ip_spec;
+	pattern[1].mask = &ip_mask;
+
+	if (key->proto == IPPROTO_TCP) {
+		memset(&tcp_spec, 0, sizeof(struct rte_flow_item_tcp));
+		memset(&tcp_mask, 0, sizeof(struct rte_flow_item_tcp));
+		tcp_spec.hdr.src_port = key->port_src;
+		tcp_mask.hdr.src_port = 0xffff;
+		tcp_spec.hdr.dst_port = key->port_dst;
+		tcp_mask.hdr.dst_port = 0xffff;
+		pattern[2].type = RTE_FLOW_ITEM_TYPE_TCP;
+		pattern[2].spec = &tcp_spec;
+		pattern[2].mask = &tcp_mask;
+	} else {
+		memset(&udp_spec, 0, sizeof(struct rte_flow_item_udp));
+		memset(&udp_mask, 0, sizeof(struct rte_flow_item_udp));
+		udp_spec.hdr.src_port = key->port_src;
+		udp_mask.hdr.src_port = 0xffff;
+		udp_spec.hdr.dst_port = key->port_dst;
+		udp_mask.hdr.dst_port = 0xffff;
+		pattern[2].type = RTE_FLOW_ITEM_TYPE_UDP;
+		pattern[2].spec = &udp_spec;
+		pattern[2].mask = &udp_mask;
+	}
+
+	/* the final level must be always type end */
+	pattern[3].type = RTE_FLOW_ITEM_TYPE_END;
+
+	res = rte_flow_validate(port_id, &attr, pattern, action, error);
+	if (!res)
+		flow = rte_flow_create(port_id, &attr, pattern, action, error);
+
+	return flow;
+}
+
+/* mark the packets of a flow with mark_id, keeping them on rx_q */
+struct rte_flow *
+generate_mark_flow(uint16_t port_id, uint16_t rx_q,
+		const union rte_table_netflow_key *key, uint32_t mark_id,
+		struct rte_flow_error *error)
+{
+	return generate_5tuple_flow(port_id, rx_q, key, 1, mark_id,
+			FLOW_PRIO_MARK, error);
+}
+
+/* send the packets of a flow to rx_q, overriding RSS and MARK rules */
+struct rte_flow *
+generate_steer_flow(uint16_t port_id, uint16_t rx_q,
+		const union rte_table_netflow_key *key,
+		struct rte_flow_error *error)
+{
+	return generate_5tuple_flow(port_id, rx_q, key, 0, 0,
+			FLOW_PRIO_STEER, error);
+}
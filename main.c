@@ -2,6 +2,10 @@
  * Copyright 2017 Mellanox Technologies, Ltd
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* sendmmsg() */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +14,7 @@
 #include <sys/types.h>
 #include <sys/queue.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <setjmp.h>
 #include <stdarg.h>
 #include <ctype.h>
@@ -17,6 +22,8 @@
 #include <getopt.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <rte_eal.h>
 #include <rte_common.h>
@@ -33,22 +40,62 @@ static volatile bool force_quit;
 
 static uint16_t port_id;
 static uint16_t nr_queues = 5;
+#define NB_RXD 512U		/* rx descriptors per queue */
 static uint8_t selected_queue = 1;
-struct rte_mempool *mbuf_pool;
 struct rte_flow *flow;
-struct rte_table_netflow *table;
 
 #define SRC_IP ((0<<24) + (0<<16) + (0<<8) + 0) /* src ip = 0.0.0.0 */
 #define DEST_IP ((192<<24) + (168<<16) + (1<<8) + 1) /* dest ip = 192.168.1.1 */
 #define FULL_MASK 0xffffffff /* full mask */
 #define EMPTY_MASK 0x0 /* empty mask */
 
+#include "probe.h"
+
+probe_t probe;
+static struct rte_mempool *mbuf_pools[_NB_SOCKETS];	/* rx mbufs, on the sockets with ports */
+
 #include "flow_blocks.c"
 #include "rte_table_netflow.c"
 #include "probe.c"
+#include "netflow-writer.c"
+#include "netflow-offload.c"
+#include "netflow-topn.c"
+#include "netflow-export.c"
 
 void* export_thread_func (void* arg);
 
+/* Flow table hashing, see --hash and --hash-seed */
+static rte_table_netflow_op_hash netflow_f_hash = rte_table_netflow_hash_crc32;
+static rte_table_netflow_op_hash_bulk netflow_f_hash_bulk;
+static uint64_t netflow_hash_seed;
+
+/* Flow export, see --collector and --snapshot */
+static char collector_addr[16];
+static int collector_port;
+static uint8_t collector_version = FLOW_VERSION_5;
+static const char *snapshot_path;
+
+/* Export files, see --export-dir */
+static const char *export_dir;
+
+/* MARK rules for heavy flows, see --offload-rules */
+static unsigned int offload_rules;
+
+/* Elephant flow steering, see --steer-rules and --steer-rate */
+static unsigned int steer_rules;
+static uint64_t steer_rate_mbps = 1000;
+
+/* Heavy hitter report, see --top-talkers and --top-file */
+static unsigned int top_talkers;
+static const char *top_path = "/tmp/netflow.top";
+
+/* Index the flow tables with the NIC's RSS hash when possible, see --no-rss-hash */
+static bool rss_hash = true;
+static uint64_t export_rotate_mb = 256;
+static unsigned int export_rotate_secs = 300;
+
+#define EXPORT_IDLE_US 100      /* export lcore nap when no flow expired */
+
 static inline void
 print_ether_addr(const char *what, struct ether_addr *eth_addr)
 {
@@ -59,87 +106,49 @@ print_ether_addr(const char *what, struct ether_addr *eth_addr)
 
 
 #define NETFLOW_HASH_ENTRIES 2 * 1024 * 1024
+#define NETFLOW_HASH6_ENTRIES 1 * 1024 * 1024
 
 static void
 setup_netflow_table(void)
 {
     struct rte_table_netflow_params param = {
-        .n_entries = NETFLOW_HASH_ENTRIES,
+        /* buckets are preallocated: split the flow budget over the shards */
+        .n_entries = rte_align32pow2(NETFLOW_HASH_ENTRIES / probe.nb_workers),
         .offset = 0,
-        .f_hash = rte_hash_crc_4byte,
-        .seed = 0,
+        .f_hash = netflow_f_hash,
+        .f_hash_bulk = netflow_f_hash_bulk,
+        .seed = netflow_hash_seed,
     };
-   
-    table = (struct rte_table_netflow *)rte_table_netflow_create(&param, 0, sizeof(hashBucket_t));
-}   
-
-#define DEBUG 0
-
-static void
-main_loop(void)
-{
-	struct rte_mbuf *mbufs[32];
-#if DEBUG
-	struct ether_hdr *eth_hdr;
-#endif
-	struct rte_flow_error error;
-	uint16_t nb_rx;
-	uint16_t i;
-	uint16_t j;
-	int pkt_cnt = 0;
-
-	while (!force_quit) {
-		for (i = 0; i < nr_queues; i++) {
-			nb_rx = rte_eth_rx_burst(port_id,
-						i, mbufs, 32);
-			if (nb_rx) {
-				packet_classify_bulk (mbufs, nb_rx, table);
-				for (j = 0; j < nb_rx; j++) {
-					struct rte_mbuf *m = mbufs[j];
-
-#if DEBUG
-					eth_hdr = rte_pktmbuf_mtod(m, struct ether_hdr *);
-
-					print_ether_addr("src=",
-							&eth_hdr->s_addr);
-					print_ether_addr(" - dst=",
-							&eth_hdr->d_addr);
-					printf(" - queue=0x%x",
-							(unsigned int)i);
-					printf("\n");
-#endif
+    uint8_t i, w;
 
-					rte_pktmbuf_free(m);
-				}
-				pkt_cnt += nb_rx;
-			}
-		}
-	}
-
-#if DEBUG
-	rte_table_print(table);
-#endif
-   
-   rte_table_print_stats(table);
-
-	/* closing and releasing resources */
-	rte_flow_flush(port_id, &error);
-	rte_eth_dev_stop(port_id);
-	rte_eth_dev_close(port_id);
-}
+    /* private IPv4 and IPv6 shards per worker, on the worker's socket */
+    probe.nb_tables = 2 * probe.nb_workers;
+    for (i = 0; i < probe.nb_tables; i++) {
+        w = i % probe.nb_workers;
+        if (i == probe.nb_workers) {
+            param.n_entries = rte_align32pow2(NETFLOW_HASH6_ENTRIES / probe.nb_workers);
+            param.ipv6 = 1;
+        }
+        probe.table[i] = (struct rte_table_netflow *)rte_table_netflow_create(&param,
+                rte_lcore_to_socket_id(probe.l2p[w].lcore_id), sizeof(hashBucket_t));
+        if (probe.table[i] == NULL)
+            rte_exit(EXIT_FAILURE, "Cannot create %s flow table for lcore %u\n",
+                    param.ipv6 ? "IPv6" : "IPv4", probe.l2p[w].lcore_id);
+    }
+}   
 
 #define CHECK_INTERVAL 1000  /* 100ms */
 #define MAX_REPEAT_TIMES 90  /* 9s (90 * 100ms) in total */
 
 static void
-assert_link_status(void)
+assert_link_status(uint16_t pid)
 {
 	struct rte_eth_link link;
 	uint8_t rep_cnt = MAX_REPEAT_TIMES;
 
 	memset(&link, 0, sizeof(link));
 	do {
-		rte_eth_link_get(port_id, &link);
+		rte_eth_link_get(pid, &link);
 		if (link.link_status == ETH_LINK_UP)
 			break;
 		rte_delay_ms(CHECK_INTERVAL);
@@ -149,14 +158,60 @@ assert_link_status(void)
 		rte_exit(EXIT_FAILURE, ":: error: link is still down\n");
 }
 
+/*
+ * Toeplitz key of repeated 0x6d5a: RSS hashes a flow and its reverse alike,
+ * so both directions of a connection land on the same queue.
+ */
+#define RSS_KEY_MAX	52
+#define RSS_HF		(ETH_RSS_IP | ETH_RSS_TCP | ETH_RSS_UDP)
+
+/* what the flow table needs hashed to take the RSS hash, see packet_rss() */
+#define RSS_HF_TABLE	(ETH_RSS_NONFRAG_IPV4_TCP | ETH_RSS_NONFRAG_IPV4_UDP | \
+			 ETH_RSS_NONFRAG_IPV4_OTHER | ETH_RSS_NONFRAG_IPV6_TCP | \
+			 ETH_RSS_NONFRAG_IPV6_UDP | ETH_RSS_NONFRAG_IPV6_OTHER)
+
+static uint8_t rss_sym_key[RSS_KEY_MAX] __rte_aligned(sizeof(uint32_t));
+
+/* The port reports L3 and L4 packet types, fragments included */
+static bool
+port_has_ptypes(uint16_t pid)
+{
+	uint32_t ptypes[32];
+	bool ip = false, frag = false;
+	int i, n;
+
+	n = rte_eth_dev_get_supported_ptypes(pid,
+			RTE_PTYPE_L3_MASK | RTE_PTYPE_L4_MASK,
+			ptypes, RTE_DIM(ptypes));
+	for (i = 0; i < n && i < (int)RTE_DIM(ptypes); i++) {
+		if (RTE_ETH_IS_IPV4_HDR(ptypes[i]))
+			ip = true;
+		if ((ptypes[i] & RTE_PTYPE_L4_MASK) == RTE_PTYPE_L4_FRAG)
+			frag = true;
+	}
+	return ip && frag;
+}
+
 static void
-init_port(void)
+init_port(uint16_t pid)
 {
 	int ret;
 	uint16_t i;
+	uint16_t nb_txq;
 	struct rte_eth_conf port_conf = {
 		.rxmode = {
 			.split_hdr_size = 0,
+			/* tags land in m->vlan_tci, see packet_type() */
+			.mq_mode = ETH_MQ_RX_RSS,
+			.offloads =
+				DEV_RX_OFFLOAD_VLAN_STRIP |
+				DEV_RX_OFFLOAD_QINQ_STRIP,
+		},
+		.rx_adv_conf = {
+			.rss_conf = {
+				.rss_key = rss_sym_key,
+				.rss_hf = RSS_HF,
+			},
 		},
 		.txmode = {
 			.offloads =
@@ -172,57 +227,718 @@ init_port(void)
 	struct rte_eth_rxconf rxq_conf;
 	struct rte_eth_dev_info dev_info;
 
-	rte_eth_dev_info_get(port_id, &dev_info);
+	/* the export port gets one more tx queue, for the export lcore */
+	nb_txq = nr_queues + (pid == probe.collector.tx_port);
+
+	rte_eth_dev_info_get(pid, &dev_info);
+	port_conf.rxmode.offloads &= dev_info.rx_offload_capa;
 	port_conf.txmode.offloads &= dev_info.tx_offload_capa;
-	printf(":: initializing port: %d\n", port_id);
-	ret = rte_eth_dev_configure(port_id,
-				nr_queues, nr_queues, &port_conf);
+	if (rss_sym_key[0] == 0) {
+		for (i = 0; i < RSS_KEY_MAX; i++)
+			rss_sym_key[i] = (i & 1) ? 0x5a : 0x6d;
+		rte_convert_rss_key((const uint32_t *)rss_sym_key,
+			probe.rss_key_be, RSS_SOFT_KEY_LEN);
+	}
+	port_conf.rx_adv_conf.rss_conf.rss_key_len =
+		(dev_info.hash_key_size && dev_info.hash_key_size <= RSS_KEY_MAX) ?
+		dev_info.hash_key_size : 40;
+	port_conf.rx_adv_conf.rss_conf.rss_hf &= dev_info.flow_type_rss_offloads;
+	/* the flow table takes the RSS hash only if every port hashes alike */
+	if ((port_conf.rx_adv_conf.rss_conf.rss_hf & RSS_HF_TABLE) != RSS_HF_TABLE ||
+	    !port_has_ptypes(pid)) {
+		if (probe.rss_hash)
+			printf(":: port %d: no RSS hash or packet types, "
+				"hashing flows in software\n", pid);
+		probe.rss_hash = 0;
+	}
+	if (port_conf.rx_adv_conf.rss_conf.rss_hf == 0)
+		port_conf.rxmode.mq_mode = ETH_MQ_RX_NONE;
+	probe.info[pid].tx_offloads = port_conf.txmode.offloads;
+	rte_eth_macaddr_get(pid, &probe.ports_eth_addr[pid]);
+	printf(":: initializing port: %d\n", pid);
+	ret = rte_eth_dev_configure(pid,
+				nr_queues, nb_txq, &port_conf);
 	if (ret < 0) {
 		rte_exit(EXIT_FAILURE,
 			":: cannot configure device: err=%d, port=%u\n",
-			ret, port_id);
+			ret, pid);
 	}
 
 	rxq_conf = dev_info.default_rxconf;
 	rxq_conf.offloads = port_conf.rxmode.offloads;
 	/* only set Rx queues: something we care only so far */
 	for (i = 0; i < nr_queues; i++) {
-		ret = rte_eth_rx_queue_setup(port_id, i, 512,
-				     rte_eth_dev_socket_id(port_id),
+		ret = rte_eth_rx_queue_setup(pid, i, probe.nb_rxd,
+				     rte_eth_dev_socket_id(pid),
 				     &rxq_conf,
-				     mbuf_pool);
+				     mbuf_pools[probe.info[pid].socket_id]);
 		if (ret < 0) {
 			rte_exit(EXIT_FAILURE,
 				":: Rx queue setup failed: err=%d, port=%u\n",
-				ret, port_id);
+				ret, pid);
 		}
 	}
 
 	txq_conf = dev_info.default_txconf;
 	txq_conf.offloads = port_conf.txmode.offloads;
 
-	for (i = 0; i < nr_queues; i++) {
-		ret = rte_eth_tx_queue_setup(port_id, i, 512,
-				rte_eth_dev_socket_id(port_id),
+	for (i = 0; i < nb_txq; i++) {
+		ret = rte_eth_tx_queue_setup(pid, i, 512,
+				rte_eth_dev_socket_id(pid),
 				&txq_conf);
 		if (ret < 0) {
 			rte_exit(EXIT_FAILURE,
 				":: Tx queue setup failed: err=%d, port=%u\n",
-				ret, port_id);
+				ret, pid);
 		}
 	}
 
-	rte_eth_promiscuous_enable(port_id);
-	ret = rte_eth_dev_start(port_id);
+	rte_eth_promiscuous_enable(pid);
+	ret = rte_eth_dev_start(pid);
 	if (ret < 0) {
 		rte_exit(EXIT_FAILURE,
 			"rte_eth_dev_start:err=%d, port=%u\n",
-			ret, port_id);
+			ret, pid);
+	}
+
+	assert_link_status(pid);
+
+	/* tunnels the NIC classifies skip the UDP port lookup in packet_decap() */
+	if (probe.decap.types) {
+		uint32_t ptypes[16];
+		int n = rte_eth_dev_get_supported_ptypes(pid, RTE_PTYPE_TUNNEL_MASK,
+				ptypes, RTE_DIM(ptypes));
+
+		printf(":: port %d: %d tunnel packet types recognised by the NIC\n",
+				pid, n > 0 ? n : 0);
+	}
+
+	printf(":: initializing port: %d done\n", pid);
+}
+
+#define DEBUG 0
+
+/*
+ * Run-to-completion datapath: poll every (port, queue) pair this lcore owns
+ * in its l2p entry and classify the bursts into its own flow table shard.
+ */
+static int
+lcore_main_loop(void *arg)
+{
+	l2p_t *l2p = (l2p_t *)arg;
+	struct rte_table_netflow *table = probe.table[l2p - probe.l2p];
+	struct rte_table_netflow *table6 =
+		probe.table[probe.nb_workers + (l2p - probe.l2p)];
+	struct rte_mbuf *mbufs[MAX_PKT_BURST];
+#if DEBUG
+	struct ether_hdr *eth_hdr;
+#endif
+	uint16_t nb_rx;
+	uint16_t i;
+	uint16_t j;
+
+	printf(":: lcore %u polling %u rx queue(s)\n",
+			rte_lcore_id(), l2p->nb_rxq);
+
+	while (!force_quit) {
+		for (i = 0; i < l2p->nb_rxq; i++) {
+			nb_rx = rte_eth_rx_burst(l2p->rxq[i].port_id,
+						l2p->rxq[i].queue_id, mbufs, MAX_PKT_BURST);
+			if (nb_rx) {
+				packet_classify_bulk (mbufs, nb_rx,
+						l2p->rxq[i].queue_id, table, table6);
+				for (j = 0; j < nb_rx; j++) {
+					struct rte_mbuf *m = mbufs[j];
+
+#if DEBUG
+					eth_hdr = rte_pktmbuf_mtod(m, struct ether_hdr *);
+
+					print_ether_addr("src=",
+							&eth_hdr->s_addr);
+					print_ether_addr(" - dst=",
+							&eth_hdr->d_addr);
+					printf(" - queue=0x%x",
+							(unsigned int)l2p->rxq[i].queue_id);
+					printf("\n");
+#endif
+
+					rte_pktmbuf_free(m);
+				}
+			}
+		}
+
+		rte_table_netflow_expire(table);
+		rte_table_netflow_expire(table6);
+	}
+
+	return 0;
+}
+
+/* Index of a NUMA socket in the per socket arrays; unknown (-1) is 0 */
+static int
+socket_index(int socket_id)
+{
+	if (socket_id < 0 || socket_id >= _NB_SOCKETS)
+		return 0;
+	return socket_id;
+}
+
+static int
+lcore_socket(unsigned int lcore_id)
+{
+	return socket_index(rte_lcore_to_socket_id(lcore_id));
+}
+
+/*
+ * One mbuf pool per socket with ports, so a NIC writes packets to memory
+ * of its own socket. Every rx descriptor of the socket's ports may hold
+ * an mbuf.
+ */
+static void
+setup_mbuf_pools(void)
+{
+	unsigned int nb_ports[_NB_SOCKETS] = { 0 };
+	char name[RTE_MEMPOOL_NAMESIZE];
+	uint16_t pid;
+	int s;
+
+	for (pid = 0; pid < probe.nb_ports; pid++)
+		nb_ports[probe.info[pid].socket_id]++;
+
+	for (s = 0; s < _NB_SOCKETS; s++) {
+		if (nb_ports[s] == 0)
+			continue;
+		snprintf(name, sizeof(name), "mbuf_pool_%d", s);
+		mbuf_pools[s] = rte_pktmbuf_pool_create(name,
+					RTE_MAX(4096U, nb_ports[s] * nr_queues *
+					(NB_RXD + MAX_PKT_BURST) + rte_lcore_count() * 128U),
+					128, 0,
+					RTE_MBUF_DEFAULT_BUF_SIZE, s);
+		if (mbuf_pools[s] == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot init mbuf pool on socket %d\n", s);
+	}
+}
+
+/*
+ * Fill probe.l2p: every enabled slave lcore becomes a worker and the
+ * (port, queue) pairs of a port are dealt out round-robin to the workers
+ * on the port's socket, or to all workers if it has none. With two or
+ * more slave lcores the last one, preferably on the socket of the export
+ * port, is kept for flow export, otherwise the master exports. Without
+ * slave lcores the master lcore polls everything itself. Mappings that
+ * cross sockets are reported.
+ */
+static void
+setup_l2p(void)
+{
+	unsigned int lcore_id;
+	uint16_t pid, q;
+	uint8_t w;
+	uint8_t local[_NB_SOCKETS][_MAX_LCORE], nb_local[_NB_SOCKETS] = { 0 };
+	uint8_t next[_NB_SOCKETS] = { 0 }, next_any = 0;
+	int socket;
+	l2p_t *l2p;
+
+	unsigned int last_slave = RTE_MAX_LCORE;
+
+	memset(probe.l2p, 0, sizeof(probe.l2p));
+	probe.nb_workers = 0;
+	probe.export_lcore = rte_get_master_lcore();
+
+	if (rte_lcore_count() > 2) {
+		RTE_LCORE_FOREACH_SLAVE(lcore_id)
+			last_slave = lcore_id;
+		if (probe.collector.tx_port >= 0)
+			RTE_LCORE_FOREACH_SLAVE(lcore_id)
+				if (lcore_socket(lcore_id) ==
+				    probe.info[probe.collector.tx_port].socket_id)
+					last_slave = lcore_id;
+		probe.export_lcore = last_slave;
+	}
+
+	RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+		if (lcore_id == last_slave || probe.nb_workers == _MAX_LCORE)
+			continue;
+		probe.l2p[probe.nb_workers++].lcore_id = lcore_id;
+	}
+	if (probe.nb_workers == 0)
+		probe.l2p[probe.nb_workers++].lcore_id = rte_get_master_lcore();
+
+	for (w = 0; w < probe.nb_workers; w++) {
+		socket = lcore_socket(probe.l2p[w].lcore_id);
+		local[socket][nb_local[socket]++] = w;
+	}
+
+	for (pid = 0; pid < probe.nb_ports; pid++) {
+		socket = probe.info[pid].socket_id;
+		for (q = 0; q < probe.nb_queues; q++) {
+			if (nb_local[socket] != 0) {
+				w = local[socket][next[socket]];
+				next[socket] = (next[socket] + 1) % nb_local[socket];
+			} else {
+				w = next_any;
+				next_any = (next_any + 1) % probe.nb_workers;
+			}
+			l2p = &probe.l2p[w];
+			if (l2p->nb_rxq == _MAX_RXQ_PER_LCORE)
+				rte_exit(EXIT_FAILURE,
+					":: too many rx queues for lcore %u\n",
+					l2p->lcore_id);
+			l2p->rxq[l2p->nb_rxq].port_id = pid;
+			l2p->rxq[l2p->nb_rxq].queue_id = q;
+			l2p->nb_rxq++;
+		}
+	}
+
+	for (w = 0; w < probe.nb_workers; w++) {
+		l2p = &probe.l2p[w];
+		socket = lcore_socket(l2p->lcore_id);
+		printf(":: lcore %u (socket %d):", l2p->lcore_id, socket);
+		for (q = 0; q < l2p->nb_rxq; q++)
+			printf(" (port %u, queue %u)",
+				l2p->rxq[q].port_id, l2p->rxq[q].queue_id);
+		printf(l2p->nb_rxq ? "\n" : " no rx queue on its socket\n");
+	}
+	printf(":: lcore %u (socket %d): flow export\n", probe.export_lcore,
+		lcore_socket(probe.export_lcore));
+
+	/* every packet and flow update of these crosses the socket interconnect */
+	for (pid = 0; pid < probe.nb_ports; pid++) {
+		socket = probe.info[pid].socket_id;
+		if (nb_local[socket] == 0)
+			printf(":: warn: port %u is on socket %d, which has no worker "
+				"lcore; its packets cross sockets\n", pid, socket);
+	}
+	if (probe.collector.tx_port >= 0 &&
+	    lcore_socket(probe.export_lcore) !=
+	    probe.info[probe.collector.tx_port].socket_id)
+		printf(":: warn: export lcore %u is on socket %d, export port %d "
+			"on socket %d\n", probe.export_lcore,
+			lcore_socket(probe.export_lcore), probe.collector.tx_port,
+			probe.info[probe.collector.tx_port].socket_id);
+}
+
+/*
+ * Flow export loop: ship the flows the workers expired to the collector
+ * as they come, and once a second the deltas of the flows active in the
+ * last second, to the collector, the export files and the snapshot file.
+ * It is the only consumer of the shards' export rings.
+ */
+static int
+export_lcore_main(__attribute__((unused)) void *arg)
+{
+	uint64_t hz = rte_get_tsc_hz();
+	uint64_t prev_tsc = rte_rdtsc();
+	uint64_t cur_tsc;
+
+	while (!force_quit) {
+		if (netflow_export_poll() == 0)
+			usleep(EXPORT_IDLE_US);
+		netflow_writer_poll();
+		netflow_offload_poll();
+
+		cur_tsc = rte_rdtsc();
+		if (cur_tsc - prev_tsc >= hz) {
+			prev_tsc = cur_tsc;
+			netflow_export_dirty();
+			netflow_offload_balance();
+			netflow_topn_report();
+			netflow_writer_flush();
+			rte_table_print_packet_count(probe.table,
+					probe.nb_tables);
+		}
 	}
+	netflow_export_poll();
+	netflow_writer_stop();
+
+	return 0;
+}
+
+static void
+main_loop(void)
+{
+	struct rte_flow_error error;
+	pthread_t exp_thread;
+	uint16_t pid;
+	uint8_t w;
 
-	assert_link_status();
+	if (probe.l2p[0].lcore_id == rte_get_master_lcore()) {
+		/* single core mode, export from a plain thread */
+		if (pthread_create(&exp_thread, NULL, export_thread_func, NULL) != 0)
+			rte_exit(EXIT_FAILURE, ":: cannot start export thread\n");
+		lcore_main_loop(&probe.l2p[0]);
+		pthread_join(exp_thread, NULL);
+	} else {
+		for (w = 0; w < probe.nb_workers; w++)
+			rte_eal_remote_launch(lcore_main_loop, &probe.l2p[w],
+					probe.l2p[w].lcore_id);
+
+		if (probe.export_lcore == rte_get_master_lcore()) {
+			export_lcore_main(NULL);
+		} else {
+			rte_eal_remote_launch(export_lcore_main, NULL,
+					probe.export_lcore);
+			while (!force_quit)
+				rte_delay_ms(CHECK_INTERVAL);
+		}
+
+		rte_eal_mp_wait_lcore();
+	}
 
-	printf(":: initializing port: %d done\n", port_id);
+#if DEBUG
+	for (w = 0; w < probe.nb_tables; w++)
+		rte_table_print(probe.table[w]);
+#endif
+   
+   rte_table_print_stats(probe.table, probe.nb_tables);
+   netflow_export_print_stats();
+   netflow_writer_print_stats();
+   netflow_offload_print_stats();
+   netflow_topn_print_stats();
+
+	/* closing and releasing resources */
+	for (pid = 0; pid < probe.nb_ports; pid++) {
+		rte_flow_flush(pid, &error);
+		rte_eth_dev_stop(pid);
+		rte_eth_dev_close(pid);
+	}
+}
+
+static void
+usage(const char *prgname)
+{
+	printf("%s [EAL options] -- [--hash crc|mulshift|vec] [--hash-seed N] [--no-rss-hash]\n"
+		"    [--collector IP:PORT] [--export-format v5|v9|ipfix] [--snapshot FILE]\n"
+		"    [--export-port PORT --collector-mac MAC --export-src IP]\n"
+		"    [--export-dir DIR [--rotate-size MB] [--rotate-secs N]]\n"
+		"    [--decap vxlan[:PORT]|gtpu[:PORT]|gre ...] [--offload-rules N]\n"
+		"    [--steer-rules N [--steer-rate MBPS]] [--sample [PORT:]det|rand|hash:N ...]\n"
+		"    [--top-talkers N [--top-file FILE]]\n"
+		"  --hash: flow table hash function (default crc)\n"
+		"      crc: SSE4.2 CRC32 over the key\n"
+		"      mulshift: 64-bit multiply-shift\n"
+		"      vec: multiply-xorshift, hashes 4 keys per SSE4.1 op\n"
+		"  --hash-seed: seed of the flow table hash (default 0)\n"
+		"  --no-rss-hash: hash flows in software even on NICs that\n"
+		"      provide RSS hashes and packet types\n"
+		"  --collector: send expired flows to IP:PORT\n"
+		"  --export-format: collector protocol (default v5)\n"
+		"      v5: NetFlow v5, 32-bit counters\n"
+		"      v9, ipfix: template based, 64-bit counters, full messages\n"
+		"  --export-port: send to the collector from DPDK port PORT\n"
+		"      instead of a kernel socket, on a tx queue of its own\n"
+		"  --collector-mac: MAC of the collector or of the next hop\n"
+		"  --export-src: source IPv4 address of the export datagrams\n"
+		"  --export-dir: also write the export PDUs to files in DIR\n"
+		"  --rotate-size: start a new export file after MB megabytes\n"
+		"      (default 256)\n"
+		"  --rotate-secs: start a new export file after N seconds\n"
+		"      (default 300)\n"
+		"  --decap: account tunnelled packets as their inner flow,\n"
+		"      keyed on the tunnel id too; repeat for more tunnels\n"
+		"      vxlan: VXLAN on UDP port PORT (default 4789)\n"
+		"      gtpu: GTP-U on UDP port PORT (default 2152)\n"
+		"      gre: GRE, keyed on the GRE key\n"
+		"  --offload-rules: have the NIC mark the packets of up to N\n"
+		"      heavy IPv4 TCP/UDP flows, accounted without a lookup\n"
+		"      (default 0, off)\n"
+		"  --steer-rules: move up to N elephant flows off lcores whose\n"
+		"      rx rings fill up, to the least busy lcore (default 0, off)\n"
+		"  --steer-rate: elephant flows send MBPS Mbit/s or more\n"
+		"      (default 1000)\n"
+		"  --sample: account 1 in N packets of PORT, or of every port;\n"
+		"      N is at most 16383 and goes to the collector\n"
+		"      det: every N-th packet\n"
+		"      rand: each packet with probability 1/N\n"
+		"      hash: all packets of the flows whose key hashes into\n"
+		"      1/N of the range, the same flows on every probe\n"
+		"  --top-talkers: write the N heaviest flows of every second,\n"
+		"      by packets, to a text file; they are tracked in a fixed\n"
+		"      size sketch, also when the flow table is full (N <= 64)\n"
+		"  --top-file: the top talkers file (default /tmp/netflow.top)\n"
+		"  --snapshot: write live flows to binary FILE every second\n"
+		"      (default /tmp/netflow.snap when no collector nor\n"
+		"      export directory is given,\n"
+		"      tools/netflow-snap2csv turns it into CSV)\n",
+		prgname);
+}
+
+/* Add one --decap tunnel, "vxlan[:PORT]", "gtpu[:PORT]" or "gre" */
+static int
+parse_decap(const char *arg)
+{
+	decap_t *d = &probe.decap;
+	const char *colon = strchr(arg, ':');
+	size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+	uint8_t type;
+	long port;
+	char *end;
+
+	if (len == 3 && strncmp(arg, "gre", 3) == 0 && colon == NULL) {
+		d->types |= 1 << NETFLOW_TUNNEL_GRE;
+		return 0;
+	}
+	if (len == 5 && strncmp(arg, "vxlan", 5) == 0) {
+		type = NETFLOW_TUNNEL_VXLAN;
+		port = 4789;
+	} else if (len == 4 && strncmp(arg, "gtpu", 4) == 0) {
+		type = NETFLOW_TUNNEL_GTPU;
+		port = 2152;
+	} else
+		return -1;
+
+	if (colon != NULL) {
+		port = strtol(colon + 1, &end, 10);
+		if (*end != '\0' || port <= 0 || port > UINT16_MAX)
+			return -1;
+	}
+	if (d->nb_udp == DECAP_MAX_UDP_PORTS)
+		return -1;
+	d->udp_type[d->nb_udp] = type;
+	d->udp_port[d->nb_udp++] = rte_cpu_to_be_16(port);
+	d->types |= 1 << type;
+	return 0;
+}
+
+/* Set the sampling of one or all ports, "[PORT:]det|rand|hash:N" */
+static int
+parse_sample(const char *arg)
+{
+	sampling_t smp;
+	const char *colon;
+	long port = -1, rate;
+	char *end;
+
+	memset(&smp, 0, sizeof(smp));
+	if (isdigit((unsigned char)arg[0])) {
+		port = strtol(arg, &end, 10);
+		if (*end != ':' || port >= _RTE_MAX_ETHPORTS)
+			return -1;
+		arg = end + 1;
+	}
+	colon = strchr(arg, ':');
+	if (colon == NULL)
+		return -1;
+	if (colon - arg == 3 && strncmp(arg, "det", 3) == 0)
+		smp.mode = SAMPLE_DETERMINISTIC;
+	else if (colon - arg == 4 && strncmp(arg, "rand", 4) == 0)
+		smp.mode = SAMPLE_RANDOM;
+	else if (colon - arg == 4 && strncmp(arg, "hash", 4) == 0)
+		smp.mode = SAMPLE_HASH;
+	else
+		return -1;
+	rate = strtol(colon + 1, &end, 10);
+	if (*end != '\0' || rate <= 0 || rate > SAMPLE_MAX_RATE)
+		return -1;
+	if (rate == 1)
+		memset(&smp, 0, sizeof(smp));	/* every packet, as without --sample */
+	else {
+		smp.rate = rate;
+		smp.threshold = (uint32_t)((1ULL << 32) / rate - 1);
+	}
+
+	if (port >= 0)
+		probe.sampling[port] = smp;
+	else
+		for (port = 0; port < _RTE_MAX_ETHPORTS; port++)
+			probe.sampling[port] = smp;
+	return 0;
+}
+
+static int
+parse_args(int argc, char **argv)
+{
+	static const struct option lgopts[] = {
+		{ "hash", required_argument, NULL, 'H' },
+		{ "hash-seed", required_argument, NULL, 'S' },
+		{ "collector", required_argument, NULL, 'C' },
+		{ "export-format", required_argument, NULL, 'V' },
+		{ "snapshot", required_argument, NULL, 'F' },
+		{ "export-port", required_argument, NULL, 'P' },
+		{ "collector-mac", required_argument, NULL, 'M' },
+		{ "export-src", required_argument, NULL, 'I' },
+		{ "export-dir", required_argument, NULL, 'D' },
+		{ "rotate-size", required_argument, NULL, 'R' },
+		{ "rotate-secs", required_argument, NULL, 'T' },
+		{ "decap", required_argument, NULL, 'X' },
+		{ "no-rss-hash", no_argument, NULL, 'N' },
+		{ "offload-rules", required_argument, NULL, 'O' },
+		{ "steer-rules", required_argument, NULL, 'E' },
+		{ "steer-rate", required_argument, NULL, 'B' },
+		{ "sample", required_argument, NULL, 'A' },
+		{ "top-talkers", required_argument, NULL, 'K' },
+		{ "top-file", required_argument, NULL, 'W' },
+		{ NULL, 0, NULL, 0 },
+	};
+	char *prgname = argv[0];
+	char *end, *colon;
+	long port;
+	int opt;
+	bool have_mac = false;
+	struct in_addr src;
+	uint8_t *mac;
+
+	while ((opt = getopt_long(argc, argv, "", lgopts, NULL)) != EOF) {
+		switch (opt) {
+		case 'H':
+			if (strcmp(optarg, "crc") == 0) {
+				netflow_f_hash = rte_table_netflow_hash_crc32;
+				netflow_f_hash_bulk = NULL;
+			} else if (strcmp(optarg, "mulshift") == 0) {
+				netflow_f_hash = rte_table_netflow_hash_mulshift;
+				netflow_f_hash_bulk = NULL;
+			} else if (strcmp(optarg, "vec") == 0) {
+				netflow_f_hash = rte_table_netflow_hash_vec;
+				netflow_f_hash_bulk = rte_table_netflow_hash_vec_bulk;
+			} else {
+				usage(prgname);
+				return -1;
+			}
+			break;
+		case 'S':
+			netflow_hash_seed = strtoull(optarg, &end, 0);
+			if (*end != '\0') {
+				usage(prgname);
+				return -1;
+			}
+			break;
+		case 'C':
+			colon = strrchr(optarg, ':');
+			if (colon == NULL || (size_t)(colon - optarg) >=
+					sizeof(collector_addr)) {
+				usage(prgname);
+				return -1;
+			}
+			port = strtol(colon + 1, &end, 10);
+			if (*end != '\0' || port <= 0 || port > UINT16_MAX) {
+				usage(prgname);
+				return -1;
+			}
+			memcpy(collector_addr, optarg, colon - optarg);
+			collector_addr[colon - optarg] = '\0';
+			collector_port = port;
+			break;
+		case 'V':
+			if (strcmp(optarg, "v5") == 0)
+				collector_version = FLOW_VERSION_5;
+			else if (strcmp(optarg, "v9") == 0)
+				collector_version = FLOW_VERSION_9;
+			else if (strcmp(optarg, "ipfix") == 0)
+				collector_version = FLOW_VERSION_IPFIX;
+			else {
+				usage(prgname);
+				return -1;
+			}
+			break;
+		case 'F':
+			snapshot_path = optarg;
+			break;
+		case 'P':
+			port = strtol(optarg, &end, 10);
+			if (*end != '\0' || port < 0 || port >= _RTE_MAX_ETHPORTS) {
+				usage(prgname);
+				return -1;
+			}
+			probe.collector.tx_port = port;
+			break;
+		case 'M':
+			mac = probe.collector.dst_mac.addr_bytes;
+			if (sscanf(optarg, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+					&mac[0], &mac[1], &mac[2],
+					&mac[3], &mac[4], &mac[5]) != 6) {
+				usage(prgname);
+				return -1;
+			}
+			have_mac = true;
+			break;
+		case 'I':
+			if (inet_pton(AF_INET, optarg, &src) != 1) {
+				usage(prgname);
+				return -1;
+			}
+			probe.collector.src_ip = src.s_addr;
+			break;
+		case 'D':
+			export_dir = optarg;
+			break;
+		case 'R':
+			export_rotate_mb = strtoull(optarg, &end, 10);
+			if (*end != '\0' || export_rotate_mb == 0) {
+				usage(prgname);
+				return -1;
+			}
+			break;
+		case 'T':
+			export_rotate_secs = strtoul(optarg, &end, 10);
+			if (*end != '\0' || export_rotate_secs == 0) {
+				usage(prgname);
+				return -1;
+			}
+			break;
+		case 'O':
+			offload_rules = strtoul(optarg, &end, 10);
+			if (*end != '\0') {
+				usage(prgname);
+				return -1;
+			}
+			break;
+		case 'E':
+			steer_rules = strtoul(optarg, &end, 10);
+			if (*end != '\0') {
+				usage(prgname);
+				return -1;
+			}
+			break;
+		case 'B':
+			steer_rate_mbps = strtoull(optarg, &end, 10);
+			if (*end != '\0' || steer_rate_mbps == 0) {
+				usage(prgname);
+				return -1;
+			}
+			break;
+		case 'N':
+			rss_hash = false;
+			break;
+		case 'X':
+			if (parse_decap(optarg) != 0) {
+				usage(prgname);
+				return -1;
+			}
+			break;
+		case 'A':
+			if (parse_sample(optarg) != 0) {
+				usage(prgname);
+				return -1;
+			}
+			break;
+		case 'K':
+			top_talkers = strtoul(optarg, &end, 10);
+			if (*end != '\0' || top_talkers > NETFLOW_TOPN_MAX) {
+				usage(prgname);
+				return -1;
+			}
+			break;
+		case 'W':
+			top_path = optarg;
+			break;
+		default:
+			usage(prgname);
+			return -1;
+		}
+	}
+
+	if (probe.collector.tx_port >= 0 &&
+	    (collector_port == 0 || !have_mac || probe.collector.src_ip == 0)) {
+		printf("--export-port needs --collector, --collector-mac and --export-src\n");
+		usage(prgname);
+		return -1;
+	}
+	probe.collector.tx_queue = nr_queues;
+
+	if (snapshot_path == NULL && collector_port == 0 && export_dir == NULL)
+		snapshot_path = "/tmp/netflow.snap";
+
+	return 0;
 }
 
 static void
@@ -236,15 +952,12 @@ signal_handler(int signum)
 }
 
 
-/* Thread for exporting to file */
+/* Export thread, when no lcore is left for it */
 void*
-export_thread_func (void* arg)
+export_thread_func (__attribute__((unused)) void* arg)
 {
-   while (1) {
-      sleep (1);
-      rte_table_export_to_file ("/tmp/netflow.csv");
-      rte_table_print_packet_count ();
-   }
+   export_lcore_main (NULL);
+   return NULL;
 }
 
 
@@ -253,12 +966,26 @@ main(int argc, char **argv)
 {
 	int ret;
 	uint16_t nr_ports;
+	uint16_t pid;
+	uint8_t w;
 	struct rte_flow_error error;
-   pthread_t exp_thread; /* Thread for exporting NetFlow to file */
 
 	ret = rte_eal_init(argc, argv);
 	if (ret < 0)
 		rte_exit(EXIT_FAILURE, ":: invalid EAL arguments\n");
+	argc -= ret;
+	argv += ret;
+
+	probe.collector.tx_port = -1;
+	if (parse_args(argc, argv) < 0)
+		rte_exit(EXIT_FAILURE, ":: invalid application arguments\n");
+	if (export_dir != NULL &&
+	    netflow_writer_init(export_dir, export_rotate_mb << 20,
+				export_rotate_secs) < 0)
+		rte_exit(EXIT_FAILURE, ":: cannot set up the export files\n");
+	if (netflow_export_init(collector_port ? collector_addr : NULL,
+				collector_port, collector_version) < 0)
+		rte_exit(EXIT_FAILURE, ":: cannot set up the collector\n");
 
 	force_quit = false;
 	signal(SIGINT, signal_handler);
@@ -268,21 +995,41 @@ main(int argc, char **argv)
 	if (nr_ports == 0)
 		rte_exit(EXIT_FAILURE, ":: no Ethernet ports found\n");
 	port_id = 0;
-	if (nr_ports != 1) {
-		printf(":: warn: %d ports detected, but we use only one: port %u\n",
-			nr_ports, port_id);
+	probe.nb_ports = RTE_MIN(nr_ports, _RTE_MAX_ETHPORTS);
+	probe.nb_queues = nr_queues;
+	probe.nb_rxd = NB_RXD;
+	if (nr_ports > _RTE_MAX_ETHPORTS) {
+		printf(":: warn: %d ports detected, but we use only %u\n",
+			nr_ports, probe.nb_ports);
 	}
-	mbuf_pool = rte_pktmbuf_pool_create("mbuf_pool", 4096, 128, 0,
-					    RTE_MBUF_DEFAULT_BUF_SIZE,
-					    rte_socket_id());
-	if (mbuf_pool == NULL)
-		rte_exit(EXIT_FAILURE, "Cannot init mbuf pool\n");
+	for (pid = 0; pid < probe.nb_ports; pid++)
+		probe.info[pid].socket_id = socket_index(rte_eth_dev_socket_id(pid));
+	setup_mbuf_pools();
 
-	init_port();
+	if (probe.collector.tx_port >= probe.nb_ports)
+		rte_exit(EXIT_FAILURE, ":: no export port %d\n",
+			probe.collector.tx_port);
+	probe.rss_hash = rss_hash;
+	for (pid = 0; pid < probe.nb_ports; pid++)
+		init_port(pid);
+	if (probe.collector.tx_port >= 0 && netflow_export_tx_setup() < 0)
+		rte_exit(EXIT_FAILURE, ":: cannot set up the export port\n");
+	setup_l2p();
 	setup_netflow_table();
-
-   //Setup thread for handling exports
-   pthread_create(&exp_thread, NULL, export_thread_func, NULL);
+	if (offload_rules && netflow_offload_init(offload_rules) < 0)
+		rte_exit(EXIT_FAILURE, ":: cannot set up %u MARK rules\n",
+			offload_rules);
+	if (steer_rules)
+		netflow_offload_steer_init(steer_rules, steer_rate_mbps * 1000000);
+	if (top_talkers && netflow_topn_init(top_talkers, top_path) < 0)
+		rte_exit(EXIT_FAILURE, ":: cannot set up the top talkers sketches\n");
+	if (snapshot_path != NULL) {
+		probe.snapshot = rte_table_snapshot_create(snapshot_path,
+				probe.table, probe.nb_tables);
+		if (probe.snapshot == NULL)
+			rte_exit(EXIT_FAILURE, ":: cannot create snapshot %s\n",
+				snapshot_path);
+	}
 
 	/* create flow for send packet with */
 #if 1
@@ -298,7 +1045,9 @@ main(int argc, char **argv)
 #endif
 	main_loop();
 
-	rte_table_netflow_free(table);
+	rte_table_snapshot_free(probe.snapshot);
+	for (w = 0; w < probe.nb_tables; w++)
+		rte_table_netflow_free(probe.table[w]);
 
 	return 0;
 }
@@ -32,32 +32,268 @@
 
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>
 
 #include "probe.h"
 #include "rte_table_netflow.h"
 
 #include <rte_byteorder.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_udp.h>
+#include <rte_mbuf.h>
+#include <rte_ethdev.h>
 
 #include "netflow-export.h"
+#include "netflow-writer.h"
+#include "netflow-offload.h"
 
 extern probe_t probe;
 
 /* Global Variable */
 static struct timeval initialSniffTime;
 static struct timeval actTime;
+static uint64_t initialSniffTsc;        /* TSC at initialSniffTime, flows carry TSC */
+static uint64_t actTsc;
+static uint64_t tscPerMs;
 
 uint8_t engineType, engineId;
 uint16_t sampleRate;
 uint32_t flow_sequence;
+static uint8_t samplePerPort;           /* ports sample differently, see --sample */
 
-NetFlow5Record theV5Flow;
+/* samplingAlgorithm of SAMPLE_*: flow sampling by key hash is random too */
+static const uint8_t sampleAlgo[] = {
+    [SAMPLE_NONE] = 0, [SAMPLE_DETERMINISTIC] = 1, [SAMPLE_RANDOM] = 2, [SAMPLE_HASH] = 2,
+};
+
+uint8_t exportVersion = FLOW_VERSION_5;
+
+/*
+ * PDUs waiting for the next sendmmsg() or rte_eth_tx_burst(). The encoders
+ * write at exportIovs[].iov_base: exportPdus[] for the kernel socket, the
+ * payload of exportMbufs[] behind the Ethernet/IPv4/UDP headers when
+ * exporting through a DPDK port.
+ */
+typedef union {
+    NetFlow5Record v5;
+    uint8_t raw[NETFLOW_EXPORT_MSG_SIZE];   /* v9/IPFIX message */
+} exportPdu_t;
+
+static exportPdu_t exportPdus[NETFLOW_EXPORT_BATCH];
+static struct mmsghdr exportMsgs[NETFLOW_EXPORT_BATCH];
+static struct iovec exportIovs[NETFLOW_EXPORT_BATCH];
+static unsigned int exportQueued;
+static uint8_t exportEnabled;
+
+#define EXPORT_HDR_LEN  (sizeof(struct ether_hdr) + sizeof(struct ipv4_hdr) + sizeof(struct udp_hdr))
+#define EXPORT_TX_RETRIES   16          /* tx_burst calls before dropping a batch */
+#define EXPORT_POOL_SIZE    2047        /* tx ring + batch, freed by the PMD on completion */
+
+static struct rte_mempool *exportPool;
+static struct rte_mbuf *exportMbufs[NETFLOW_EXPORT_BATCH];
+static uint16_t exportIpId;
+
+/* PDU or message being filled in batch slot exportQueued */
+static uint16_t msgLen;                 /* bytes used, 0 = no open message */
+static uint16_t msgRecords;             /* flow records in it */
+static uint8_t msgTemplates;            /* template records in it */
+static uint16_t msgSetOff;              /* offset of the open data set header */
+static uint16_t msgSetId;               /* its template, IPv4 or IPv6 flows */
+static uint32_t msgSinceTemplate = NETFLOW_TEMPLATE_REFRESH;
+
+static uint64_t exported_flows;
+static uint64_t skipped_v6_flows;       /* IPv6 flows, which v5 cannot carry */
+static uint64_t exported_pdus;
+static uint64_t send_errors;
+
+/* v5 sampleRate: the mode in the top 2 bits, 1 deterministic, 2 random,
+ * and N in the low 14 bits */
+static uint16_t sampleV5Rate(const sampling_t *s) {
+    if (s->mode == SAMPLE_NONE)
+        return 0;
+    return (uint16_t)((s->mode == SAMPLE_DETERMINISTIC ? 1 : 2) << 14 | s->rate);
+}
+
+/*
+ * Set up the exporter for version 5, 9 or 10 (IPFIX). addr may be NULL,
+ * then expired flows are only recycled, not sent anywhere.
+ */
+int netflow_export_init(const char *addr, int port, uint8_t version) {
+    unsigned int i;
 
-void netflow_export_init() {
     gettimeofday(&initialSniffTime, NULL);
+    initialSniffTsc = rte_rdtsc();
+    tscPerMs = rte_get_tsc_hz() / 1000;
     engineType = 0;
     engineId = 0;
-    sampleRate = 0;
+    sampleRate = sampleV5Rate(&probe.sampling[0]);
+    for (i = 1; i < _RTE_MAX_ETHPORTS; i++)
+        if (memcmp(&probe.sampling[i], &probe.sampling[0], sizeof(sampling_t)) != 0)
+            samplePerPort = 1;
+    if (samplePerPort && version == FLOW_VERSION_5) {
+        printf("NetFlow v5 carries one sampling rate, not one per port\n");
+        return -1;
+    }
+    exportVersion = version;
+
+    probe.collector.sockfd = -1;
+    for (i = 0; i < NETFLOW_EXPORT_BATCH; i++)
+        exportIovs[i].iov_base = &exportPdus[i];
+
+    /* PDUs are also built when they only go to the export files */
+    exportEnabled = netflow_writer_enabled();
+    if (addr == NULL)
+        return 0;
+
+    snprintf(probe.collector.addr, sizeof(probe.collector.addr), "%s", addr);
+    probe.collector.port = port;
+    memset(&probe.collector.servaddr, 0, sizeof(probe.collector.servaddr));
+    probe.collector.servaddr.sin_family = AF_INET;
+    probe.collector.servaddr.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &probe.collector.servaddr.sin_addr) != 1) {
+        printf("invalid collector address %s\n", addr);
+        return -1;
+    }
+
+    exportEnabled = 1;
+    printf(":: exporting %s to %s:%d\n",
+           version == FLOW_VERSION_IPFIX ? "IPFIX" :
+           version == FLOW_VERSION_9 ? "NetFlow v9" : "NetFlow v5", addr, port);
+
+    /* sent from a DPDK port, see netflow_export_tx_setup() */
+    if (probe.collector.tx_port >= 0)
+        return 0;
+
+    if ((probe.collector.sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        printf("socket failed with error %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < NETFLOW_EXPORT_BATCH; i++) {
+        exportMsgs[i].msg_hdr.msg_name = &probe.collector.servaddr;
+        exportMsgs[i].msg_hdr.msg_namelen = sizeof(probe.collector.servaddr);
+        exportMsgs[i].msg_hdr.msg_iov = &exportIovs[i];
+        exportMsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return 0;
+}
+
+/* Point every free batch slot at the payload of a fresh mbuf. A slot left
+ * without one (pool empty) still gets encoded, and is dropped at flush. */
+static void exportTxRefill(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < NETFLOW_EXPORT_BATCH; i++) {
+        if (exportMbufs[i] == NULL)
+            exportMbufs[i] = rte_pktmbuf_alloc(exportPool);
+        exportIovs[i].iov_base = (exportMbufs[i] != NULL) ?
+            rte_pktmbuf_mtod_offset(exportMbufs[i], void *, EXPORT_HDR_LEN) :
+            (void *)&exportPdus[i];
+    }
+}
+
+/*
+ * Switch the exporter to build its datagrams in mbufs and send them on
+ * probe.collector.tx_queue of probe.collector.tx_port, so the collector
+ * may sit behind a DPDK port. Called once that port is started.
+ */
+int netflow_export_tx_setup(void)
+{
+    uint16_t pid = probe.collector.tx_port;
+
+    exportPool = rte_pktmbuf_pool_create("export_pool", EXPORT_POOL_SIZE,
+            NETFLOW_EXPORT_BATCH, 0, RTE_MBUF_DEFAULT_BUF_SIZE,
+            rte_eth_dev_socket_id(pid));
+    if (exportPool == NULL) {
+        printf("cannot create the export mbuf pool\n");
+        return -1;
+    }
+    exportTxRefill();
+
+    printf(":: export through port %u queue %u\n", pid, probe.collector.tx_queue);
+    return 0;
+}
+
+/* Prepend Ethernet/IPv4/UDP headers to the len bytes of PDU in m, leaving
+ * the checksums to the NIC when it can */
+static void exportTxHeaders(struct rte_mbuf *m, uint16_t len)
+{
+    uint16_t pid = probe.collector.tx_port;
+    uint64_t offloads = probe.info[pid].tx_offloads;
+    struct ether_hdr *eth = rte_pktmbuf_mtod(m, struct ether_hdr *);
+    struct ipv4_hdr *ip = (struct ipv4_hdr *)(eth + 1);
+    struct udp_hdr *udp = (struct udp_hdr *)(ip + 1);
+
+    ether_addr_copy(&probe.collector.dst_mac, &eth->d_addr);
+    ether_addr_copy(&probe.ports_eth_addr[pid], &eth->s_addr);
+    eth->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+    ip->version_ihl = 0x45;
+    ip->type_of_service = 0;
+    ip->total_length = rte_cpu_to_be_16(sizeof(*ip) + sizeof(*udp) + len);
+    ip->packet_id = rte_cpu_to_be_16(exportIpId++);
+    ip->fragment_offset = 0;
+    ip->time_to_live = 64;
+    ip->next_proto_id = IPPROTO_UDP;
+    ip->hdr_checksum = 0;
+    ip->src_addr = probe.collector.src_ip;
+    ip->dst_addr = probe.collector.servaddr.sin_addr.s_addr;
+
+    udp->src_port = probe.collector.servaddr.sin_port;
+    udp->dst_port = probe.collector.servaddr.sin_port;
+    udp->dgram_len = rte_cpu_to_be_16(sizeof(*udp) + len);
+    udp->dgram_cksum = 0;
+
+    m->data_len = EXPORT_HDR_LEN + len;
+    m->pkt_len = m->data_len;
+    m->l2_len = sizeof(*eth);
+    m->l3_len = sizeof(*ip);
+    m->ol_flags = PKT_TX_IPV4;
+
+    if (offloads & DEV_TX_OFFLOAD_IPV4_CKSUM)
+        m->ol_flags |= PKT_TX_IP_CKSUM;
+    else
+        ip->hdr_checksum = rte_ipv4_cksum(ip);
+
+    if (offloads & DEV_TX_OFFLOAD_UDP_CKSUM) {
+        m->ol_flags |= PKT_TX_UDP_CKSUM;
+        udp->dgram_cksum = rte_ipv4_phdr_cksum(ip, m->ol_flags);
+    } else {
+        udp->dgram_cksum = rte_ipv4_udptcp_cksum(ip, udp);
+    }
+}
+
+/* rte_eth_tx_burst() flavour of netflow_export_flush() */
+static void exportTxFlush(void)
+{
+    struct rte_mbuf *pkts[NETFLOW_EXPORT_BATCH];
+    unsigned int i, n = 0, sent = 0, retry = 0;
+
+    for (i = 0; i < exportQueued; i++) {
+        if (exportMbufs[i] == NULL) {
+            send_errors++;
+            continue;
+        }
+        exportTxHeaders(exportMbufs[i], exportIovs[i].iov_len);
+        pkts[n++] = exportMbufs[i];
+        exportMbufs[i] = NULL;
+    }
+
+    while (sent < n && retry++ < EXPORT_TX_RETRIES)
+        sent += rte_eth_tx_burst(probe.collector.tx_port, probe.collector.tx_queue,
+                                 &pkts[sent], n - sent);
+    for (i = sent; i < n; i++)
+        rte_pktmbuf_free(pkts[i]);
+
+    send_errors += n - sent;
+    exported_pdus += sent;
+    exportQueued = 0;
+    exportTxRefill();
 }
 
 /* ****************************************************** */
@@ -69,174 +305,487 @@ u_int32_t msTimeDiff(struct timeval end, struct timeval begin) {
     return((end.tv_sec-begin.tv_sec)*1000+(end.tv_usec-begin.tv_usec)/1000);
 }
 
+/* Milliseconds of sysUptime at a TSC timestamp, the only place flow time is converted */
+static u_int32_t msTimeSince(uint64_t tsc) {
+  return (tsc - initialSniffTsc) / tscPerMs;
+}
+
+/* Wall clock and TSC of the export, taken once per batch of PDUs */
+static void exportTime(void) {
+  gettimeofday(&actTime, NULL);
+  actTsc = rte_rdtsc();
+}
+
 /******************************************************* */
 
 void initNetFlowV5Header(NetFlow5Record *theV5Flow) {
   memset(&theV5Flow->flowHeader, 0, sizeof(theV5Flow->flowHeader));
 
   theV5Flow->flowHeader.version        = rte_cpu_to_be_16(5);
-  theV5Flow->flowHeader.sysUptime      = rte_cpu_to_be_32(msTimeDiff(actTime,
-                              initialSniffTime));
+  theV5Flow->flowHeader.sysUptime      = rte_cpu_to_be_32(msTimeSince(actTsc));
   theV5Flow->flowHeader.unix_secs      = rte_cpu_to_be_32(actTime.tv_sec);
-  theV5Flow->flowHeader.unix_nsecs     = rte_cpu_to_be_32(actTime.tv_usec/1000);
-  /* NOTE: theV5Flow->flowHeader.flow_sequence will be filled by sendFlowData */
+  theV5Flow->flowHeader.unix_nsecs     = rte_cpu_to_be_32(actTime.tv_usec*1000);
+  /* NOTE: theV5Flow->flowHeader.flow_sequence will be filled by sendNetflowV5 */
   theV5Flow->flowHeader.engine_type    = (u_int8_t)engineType;
   theV5Flow->flowHeader.engine_id      = (u_int8_t)engineId;
 
   theV5Flow->flowHeader.sampleRate     = rte_cpu_to_be_16(sampleRate);
 }
 
-static int exportBucketToNetflowV5(hashBucket_t* bkt, uint8_t numFlows)
+static void exportBucketToNetflowV5(NetFlow5Record *theV5Flow, hashBucket_t* bkt, uint8_t numFlows,
+                                    uint64_t bytes, uint64_t pkts)
 {
-    theV5Flow.flowRecord[numFlows].input     = 0;           // TODO
-    theV5Flow.flowRecord[numFlows].output    = 0;           // TODO
-    theV5Flow.flowRecord[numFlows].srcaddr   = bkt->ip_src;
-    theV5Flow.flowRecord[numFlows].dstaddr   = bkt->ip_dst;
-    theV5Flow.flowRecord[numFlows].dPkts     = rte_cpu_to_be_32(bkt->pktSent);
-    theV5Flow.flowRecord[numFlows].dOctets   = rte_cpu_to_be_32(bkt->bytesSent);
-    theV5Flow.flowRecord[numFlows].first     = rte_cpu_to_be_32(msTimeDiff(bkt->firstSeenSent, initialSniffTime));
-    theV5Flow.flowRecord[numFlows].last      = rte_cpu_to_be_32(msTimeDiff(bkt->lastSeenSent, initialSniffTime));
-    theV5Flow.flowRecord[numFlows].srcport   = bkt->port_src;
-    theV5Flow.flowRecord[numFlows].dstport   = bkt->port_dst;
-    theV5Flow.flowRecord[numFlows].tos       = bkt->src2dstTos;
-    theV5Flow.flowRecord[numFlows].src_as    = 0;           // TODO
-    theV5Flow.flowRecord[numFlows].dst_as    = 0;           // TODO 
-    theV5Flow.flowRecord[numFlows].src_mask  = 0;           // TODO
-    theV5Flow.flowRecord[numFlows].dst_mask  = 0;           // TODO
-    theV5Flow.flowRecord[numFlows].tcp_flags = bkt->src2dstTcpFlags;
-    theV5Flow.flowRecord[numFlows].proto     = bkt->proto;
-}
-
-hashBucket_t* makeNetFlowV5(hashBucket_t *list)
+    struct flow_ver5_rec *rec = &theV5Flow->flowRecord[numFlows];
+
+    rec->input     = 0;           // TODO
+    rec->output    = 0;           // TODO
+    rec->srcaddr   = bkt->ip_src;
+    rec->dstaddr   = bkt->ip_dst;
+    rec->nexthop   = 0;
+    rec->dPkts     = rte_cpu_to_be_32(pkts);
+    rec->dOctets   = rte_cpu_to_be_32(bytes);
+    rec->first     = rte_cpu_to_be_32(msTimeSince(bkt->firstSeenSent));
+    rec->last      = rte_cpu_to_be_32(msTimeSince(bkt->lastSeenSent));
+    rec->srcport   = bkt->port_src;
+    rec->dstport   = bkt->port_dst;
+    rec->pad1      = 0;
+    rec->tos       = bkt->src2dstTos;
+    rec->src_as    = 0;           // TODO
+    rec->dst_as    = 0;           // TODO 
+    rec->src_mask  = 0;           // TODO
+    rec->dst_mask  = 0;           // TODO
+    rec->pad2      = 0;
+    rec->tcp_flags = bkt->src2dstTcpFlags;
+    rec->proto     = bkt->proto;
+}
+
+/*
+ * Send every queued PDU with as few sendmmsg() calls as the socket allows,
+ * copying them to the export files first
+ */
+void netflow_export_flush(void)
 {
-    uint16_t num_flows = 1;
-    hashBucket_t *temp;
-
-    /* Make header */
-    initNetFlowV5Header(&theV5Flow);
-    /* Make Records */
-    while(list != NULL) {
-        temp = list;
-        //printf("num_flows:%d\n", num_flows);
-        exportBucketToNetflowV5(list, num_flows - 1);
-        list = list->next;
-        rte_free(temp);
-        num_flows++;
-        if(num_flows > V5FLOWS_PER_PAK) break;
-    }
-    num_flows--;
-    theV5Flow.flowHeader.count = rte_cpu_to_be_16(num_flows);
-    return list; 
-}
-
-static void sendNetflowV5()
+    unsigned int sent = 0;
+    unsigned int i;
+    int ret;
+
+    if (netflow_writer_enabled())
+        for (i = 0; i < exportQueued; i++)
+            netflow_writer_append(exportIovs[i].iov_base, exportIovs[i].iov_len);
+
+    if (exportPool != NULL) {
+        exportTxFlush();
+        return;
+    }
+
+    while (probe.collector.sockfd >= 0 && sent < exportQueued) {
+        ret = sendmmsg(probe.collector.sockfd, &exportMsgs[sent], exportQueued - sent, 0);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR)
+                continue;
+            send_errors += exportQueued - sent;
+            break;
+        }
+        sent += ret;
+    }
+    exported_pdus += sent;
+    exportQueued = 0;
+}
+
+/* Queue the PDU of batch slot exportQueued, flushing when the batch is full */
+static void sendNetflowV5(void)
 {
-    int msg_length;
-    uint16_t record_count;
+    NetFlow5Record *theV5Flow = (NetFlow5Record *)exportIovs[exportQueued].iov_base;
+
+    theV5Flow->flowHeader.count = rte_cpu_to_be_16(msgRecords);
+    theV5Flow->flowHeader.flow_sequence = rte_cpu_to_be_32(flow_sequence);
+    flow_sequence += msgRecords;
+    exportIovs[exportQueued].iov_len = msgLen;
+    msgLen = 0;
 
-    theV5Flow.flowHeader.flow_sequence = rte_cpu_to_be_32(flow_sequence++);
-    record_count = rte_cpu_to_be_16(theV5Flow.flowHeader.count);
-    printf("record count:%d\n", record_count);
-    msg_length = sizeof(struct flow_ver5_hdr) + record_count * sizeof(struct flow_ver5_rec);
-    sendto(probe.collector.sockfd, (void *)&theV5Flow, msg_length, 0, (struct sockaddr *)&probe.collector.servaddr, sizeof(probe.collector.servaddr));
- 
+    if (++exportQueued == NETFLOW_EXPORT_BATCH)
+        netflow_export_flush();
 }
 
-static hashBucket_t* make_export(hashBucket_t *export_list)
+/* Append one flow to the v5 PDU being filled, sending it once full */
+static void exportBucketV5(hashBucket_t *bkt, uint64_t bytes, uint64_t pkts)
 {
-    hashBucket_t *next;
-    uint32_t count = 0;
-    gettimeofday(&actTime, NULL);
-   
-    if (5) {
-        while (export_list != NULL) {
-            export_list = makeNetFlowV5(export_list);
-            sendNetflowV5();
-        }
+    NetFlow5Record *theV5Flow = (NetFlow5Record *)exportIovs[exportQueued].iov_base;
+
+    if (msgLen == 0) {
+        initNetFlowV5Header(theV5Flow);
+        msgLen = sizeof(struct flow_ver5_hdr);
+        msgRecords = 0;
     }
-    printf("should be NULL(export_list:%p)\n", export_list);
-    return export_list;
+    exportBucketToNetflowV5(theV5Flow, bkt, msgRecords++, bytes, pkts);
+    msgLen += sizeof(struct flow_ver5_rec);
+
+    if (msgRecords == V5FLOWS_PER_PAK)
+        sendNetflowV5();
 }
-#define IDLE_TIMEOUT 60
-#define LIFETIME_TIMEOUT 120
 
-void process_hashtable()
-{
-    //temp
-    int pid = 0;
-
-    struct rte_table_netflow *t = (struct rte_table_netflow *)probe.table[pid];
-    hashBucket_t *temp, *bkt;
-    hashBucket_t *export_list = NULL;
-    struct rte_table_hashBucket *prev_next_pointer;
-
-    uint32_t i, entry, idx;
-    uint32_t sleep_time;
-    struct timeval curr, lastseen, firstseen;
-    uint32_t export_count;
- 
-    while (1) {
-        sleep_time = 60 - (time(NULL) % 60);        /* Align minutes */
-        //sleep_time = 10;
-        sleep(sleep_time);
-
-        /* check hash table */
-        entry = t->n_entries;
-        
-        export_count = 0;
-        /* loop all entry */
-        printf("Start of check:export list must null:%p\n", export_list);
-        for(i = 0; i < entry; i++) {
-            /****************************************************************
-             * Lock one entry (t->array[i]'s lock = t->lock[i]
-             *
-             * So netflow_export can use other entries 
-             ****************************************************************/
-            rte_spinlock_lock(&t->lock[i]);
-     
-            bkt = t->array[i];
-            if(likely(bkt == NULL)) {
-                rte_spinlock_unlock(&t->lock[i]); 
+/******************************************************* */
+
+/* (IANA element id, length) of every field of flow_ipfix_rec; flow_ver9_rec
+ * has them all but layer2SegmentId */
+static const uint16_t templateFields[][2] = {
+    { 8, 4 }, { 12, 4 }, { 7, 2 }, { 11, 2 }, { 4, 1 }, { 5, 1 }, { 6, 1 },
+    { 58, 2 }, { 351, 8 }, { 34, 4 }, { 35, 1 }, { 1, 8 }, { 2, 8 }, { 22, 4 }, { 21, 4 },
+};
+#define TEMPLATE_NB_FIELDS  RTE_DIM(templateFields)
+
+static inline uint16_t templateRecLen(uint16_t id) {
+    if (id == FLOW_TEMPLATE_ID_V6)
+        return exportVersion == FLOW_VERSION_IPFIX ?
+            sizeof(struct flow_ipfix_rec6) : sizeof(struct flow_ver9_rec6);
+    return exportVersion == FLOW_VERSION_IPFIX ?
+        sizeof(struct flow_ipfix_rec) : sizeof(struct flow_ver9_rec);
+}
+
+/* Append the template set, resent every NETFLOW_TEMPLATE_REFRESH messages
+ * since UDP collectors may miss it or restart. It holds both templates:
+ * FLOW_TEMPLATE_ID_V6 is FLOW_TEMPLATE_ID with IPv6 addresses. */
+static void appendTemplate(uint8_t *msg) {
+    static const uint16_t ids[] = { FLOW_TEMPLATE_ID, FLOW_TEMPLATE_ID_V6 };
+    struct flow_set_hdr *set = (struct flow_set_hdr *)(msg + msgLen);
+    uint16_t *p = (uint16_t *)(set + 1);
+    unsigned int i, t;
+
+    for (t = 0; t < RTE_DIM(ids); t++) {
+        *p++ = rte_cpu_to_be_16(ids[t]);
+        *p++ = rte_cpu_to_be_16(TEMPLATE_NB_FIELDS -
+                (exportVersion != FLOW_VERSION_IPFIX));
+        for (i = 0; i < TEMPLATE_NB_FIELDS; i++) {
+            uint16_t id = templateFields[i][0], len = templateFields[i][1];
+
+            if (exportVersion != FLOW_VERSION_IPFIX && id == 351)
                 continue;
+            if (exportVersion == FLOW_VERSION_IPFIX && (id == 22 || id == 21)) {
+                id = (id == 22) ? 152 : 153;
+                len = 8;
+            }
+            if (ids[t] == FLOW_TEMPLATE_ID_V6 && (id == 8 || id == 12)) {
+                id = (id == 8) ? 27 : 28;
+                len = 16;
             }
+            *p++ = rte_cpu_to_be_16(id);
+            *p++ = rte_cpu_to_be_16(len);
+        }
+    }
+
+    set->set_id = rte_cpu_to_be_16(exportVersion == FLOW_VERSION_IPFIX ?
+            FLOW_IPFIX_TEMPLATE_SET : FLOW_V9_TEMPLATE_SET);
+    set->length = rte_cpu_to_be_16((uint8_t *)p - (uint8_t *)set);
+    msgLen += (uint8_t *)p - (uint8_t *)set;
+    msgTemplates = RTE_DIM(ids);
+    msgSinceTemplate = 0;
+}
+
+/* Start a data set of template id in the open message */
+static void openDataSet(uint8_t *msg, uint16_t id) {
+    struct flow_set_hdr *set = (struct flow_set_hdr *)(msg + msgLen);
+
+    set->set_id = rte_cpu_to_be_16(id);
+    msgSetOff = msgLen;
+    msgSetId = id;
+    msgLen += sizeof(*set);
+}
+
+/* Pad the open data set to 4 bytes and fill in its length */
+static void closeDataSet(uint8_t *msg) {
+    struct flow_set_hdr *set = (struct flow_set_hdr *)(msg + msgSetOff);
+
+    while ((msgLen - msgSetOff) & 3)
+        msg[msgLen++] = 0;
+    set->length = rte_cpu_to_be_16(msgLen - msgSetOff);
+}
+
+/* Start a v9/IPFIX message in the next free PDU slot */
+static void openTemplateMsg(uint16_t id) {
+    uint8_t *msg = (uint8_t *)exportIovs[exportQueued].iov_base;
+
+    msgLen = (exportVersion == FLOW_VERSION_IPFIX) ?
+        sizeof(struct flow_ipfix_hdr) : sizeof(struct flow_ver9_hdr);
+    msgRecords = 0;
+    msgTemplates = 0;
+
+    if (msgSinceTemplate++ >= NETFLOW_TEMPLATE_REFRESH)
+        appendTemplate(msg);
+
+    openDataSet(msg, id);
+}
+
+/* Fill in the headers of the open message and queue it */
+static void closeTemplateMsg(void) {
+    uint8_t *msg = (uint8_t *)exportIovs[exportQueued].iov_base;
+
+    closeDataSet(msg);
+
+    if (exportVersion == FLOW_VERSION_IPFIX) {
+        struct flow_ipfix_hdr *hdr = (struct flow_ipfix_hdr *)msg;
+
+        hdr->version = rte_cpu_to_be_16(FLOW_VERSION_IPFIX);
+        hdr->length = rte_cpu_to_be_16(msgLen);
+        hdr->export_time = rte_cpu_to_be_32(actTime.tv_sec);
+        hdr->flow_sequence = rte_cpu_to_be_32(flow_sequence);
+        hdr->domain_id = rte_cpu_to_be_32(engineId);
+        flow_sequence += msgRecords;
+    } else {
+        struct flow_ver9_hdr *hdr = (struct flow_ver9_hdr *)msg;
+
+        hdr->version = rte_cpu_to_be_16(FLOW_VERSION_9);
+        hdr->count = rte_cpu_to_be_16(msgRecords + msgTemplates);
+        hdr->sysUptime = rte_cpu_to_be_32(msTimeSince(actTsc));
+        hdr->unix_secs = rte_cpu_to_be_32(actTime.tv_sec);
+        hdr->flow_sequence = rte_cpu_to_be_32(flow_sequence);
+        hdr->source_id = rte_cpu_to_be_32(engineId);
+        flow_sequence++;
+    }
+
+    exportIovs[exportQueued].iov_len = msgLen;
+    msgLen = 0;
+    if (++exportQueued == NETFLOW_EXPORT_BATCH)
+        netflow_export_flush();
+}
+
+/* Milliseconds since the epoch at a TSC timestamp */
+static uint64_t msEpoch(uint64_t tsc) {
+    return (uint64_t)initialSniffTime.tv_sec * 1000 +
+        initialSniffTime.tv_usec / 1000 + msTimeSince(tsc);
+}
+
+/* Fields after the addresses, the same in all four record layouts but for
+ * the IPFIX layer2SegmentId. A tunnelled flow's key holds its folded tunnel
+ * id in place of the VLAN. */
+#define FILL_TEMPLATE_REC(r, bkt, smp, bytes, pkts) do { \
+        (r)->srcport   = (bkt)->port_src;                 \
+        (r)->dstport   = (bkt)->port_dst;                 \
+        (r)->proto     = (bkt)->proto;                    \
+        (r)->tos       = (bkt)->src2dstTos;               \
+        (r)->tcp_flags = (bkt)->src2dstTcpFlags;          \
+        (r)->vlan      = (bkt)->tunnel == NETFLOW_TUNNEL_NONE ? \
+            rte_cpu_to_be_16((bkt)->vlanId) : 0;          \
+        (r)->sampleInt = rte_cpu_to_be_32((smp)->mode ?   \
+            (smp)->rate : 1);                             \
+        (r)->sampleAlgo = sampleAlgo[(smp)->mode];        \
+        (r)->dOctets   = rte_cpu_to_be_64(bytes);         \
+        (r)->dPkts     = rte_cpu_to_be_64(pkts);          \
+    } while (0)
+
+/*
+ * Append one flow, to a data set of the template of its address family,
+ * opening a new message when the current one is full
+ */
+static void exportBucketTemplate(struct rte_table_netflow *t, hashBucket_t *bkt,
+                                 uint64_t bytes, uint64_t pkts)
+{
+    uint16_t id = (t->addr6 != NULL) ? FLOW_TEMPLATE_ID_V6 : FLOW_TEMPLATE_ID;
+    uint16_t need = templateRecLen(id);
+    uint64_t l2seg = 0;
+    const sampling_t *smp = &probe.sampling[0];
+    uint8_t *msg, *rec;
+
+    /* layer2SegmentId: VXLAN segments are type 1 with the VNI in the low bits */
+    if (bkt->tunnel == NETFLOW_TUNNEL_VXLAN)
+        l2seg = 1ULL << 56 | rte_table_netflow_cold(t, bkt)->tun_id;
+    /* the sampling of the port the flow came in on */
+    if (samplePerPort)
+        smp = &probe.sampling[rte_table_netflow_cold(t, bkt)->port];
+
+    /* the set the record goes in is padded to 4 bytes when it is closed;
+     * switching sets also costs a set header and the padding of the open set */
+    need += 3;
+    if (msgLen != 0 && id != msgSetId)
+        need += sizeof(struct flow_set_hdr) + 3;
+    if (msgLen != 0 && msgLen + need > NETFLOW_EXPORT_MSG_SIZE)
+        closeTemplateMsg();
+
+    msg = (uint8_t *)exportIovs[exportQueued].iov_base;
+    if (msgLen == 0) {
+        openTemplateMsg(id);
+    } else if (id != msgSetId) {
+        closeDataSet(msg);
+        openDataSet(msg, id);
+    }
+
+    rec = msg + msgLen;
+    if (id == FLOW_TEMPLATE_ID_V6) {
+        const struct rte_table_netflow_addr6 *a6 = rte_table_netflow_addr6(t, bkt);
+
+        if (exportVersion == FLOW_VERSION_IPFIX) {
+            struct flow_ipfix_rec6 *r = (struct flow_ipfix_rec6 *)rec;
+
+            memcpy(r->srcaddr, a6->src, sizeof(r->srcaddr));
+            memcpy(r->dstaddr, a6->dst, sizeof(r->dstaddr));
+            FILL_TEMPLATE_REC(r, bkt, smp, bytes, pkts);
+            r->l2seg     = rte_cpu_to_be_64(l2seg);
+            r->first     = rte_cpu_to_be_64(msEpoch(bkt->firstSeenSent));
+            r->last      = rte_cpu_to_be_64(msEpoch(bkt->lastSeenSent));
+        } else {
+            struct flow_ver9_rec6 *r = (struct flow_ver9_rec6 *)rec;
+
+            memcpy(r->srcaddr, a6->src, sizeof(r->srcaddr));
+            memcpy(r->dstaddr, a6->dst, sizeof(r->dstaddr));
+            FILL_TEMPLATE_REC(r, bkt, smp, bytes, pkts);
+            r->first     = rte_cpu_to_be_32(msTimeSince(bkt->firstSeenSent));
+            r->last      = rte_cpu_to_be_32(msTimeSince(bkt->lastSeenSent));
+        }
+    } else if (exportVersion == FLOW_VERSION_IPFIX) {
+        struct flow_ipfix_rec *r = (struct flow_ipfix_rec *)rec;
+
+        r->srcaddr   = bkt->ip_src;
+        r->dstaddr   = bkt->ip_dst;
+        FILL_TEMPLATE_REC(r, bkt, smp, bytes, pkts);
+        r->l2seg     = rte_cpu_to_be_64(l2seg);
+        r->first     = rte_cpu_to_be_64(msEpoch(bkt->firstSeenSent));
+        r->last      = rte_cpu_to_be_64(msEpoch(bkt->lastSeenSent));
+    } else {
+        struct flow_ver9_rec *r = (struct flow_ver9_rec *)rec;
+
+        r->srcaddr   = bkt->ip_src;
+        r->dstaddr   = bkt->ip_dst;
+        FILL_TEMPLATE_REC(r, bkt, smp, bytes, pkts);
+        r->first     = rte_cpu_to_be_32(msTimeSince(bkt->firstSeenSent));
+        r->last      = rte_cpu_to_be_32(msTimeSince(bkt->lastSeenSent));
+    }
+    msgLen += templateRecLen(id);
+    msgRecords++;
+}
+
+/* Send out the PDU or message being filled, if any */
+static void closeMsg(void)
+{
+    if (msgLen == 0)
+        return;
+    if (exportVersion == FLOW_VERSION_5)
+        sendNetflowV5();
+    else
+        closeTemplateMsg();
+}
+
+/*
+ * Export what a flow sent since it was last exported. Records carry delta
+ * counters: a long flow goes out once per period it was active in (see
+ * netflow_export_dirty) and a last time when it expires, and the records
+ * add up to the flow's totals.
+ */
+static void exportFlow(struct rte_table_netflow *t, hashBucket_t *bkt)
+{
+    hashBucket_exp_t *e = rte_table_netflow_exp(t, bkt);
+    uint64_t bytes = bkt->bytesSent;
+    uint64_t pkts = bkt->pktSent;
+
+    if (pkts == e->pktExported && bytes == e->bytesExported)
+        return;
 
-            /* Bucket exist */
-            /* lock the entry */
-            gettimeofday(&curr, NULL);
-
-            idx = 0; 
-            while(bkt != NULL) {
-                temp = bkt->next;
-                /* check bucket timestamp */
-                lastseen = bkt->lastSeenSent;
-                firstseen = bkt->firstSeenSent;
-
-                if ( ((curr.tv_sec - lastseen.tv_sec) > IDLE_TIMEOUT)          /* data doesn't send for a while */
-                    || ((curr.tv_sec - firstseen.tv_sec) > LIFETIME_TIMEOUT)   /* flow is active, but too old   */
-                    || bkt->bucket_expired > 0 ) {
-                    /* export bucket to export_list */
-                    bkt->next = export_list;
-                    export_list = bkt;
-                    export_count++;
-                    //printf("Add to export list:%d\n", export_count);
-                    /* if first bucket is exported, we loss t->array[i] */
-                    if (idx == 0) t->array[i] = temp;
-
-                }
-                idx++;
-                bkt = temp;
+    if (exportVersion == FLOW_VERSION_5 && t->addr6 != NULL) {
+        skipped_v6_flows++;
+        return;
+    }
+
+    if (exportVersion == FLOW_VERSION_5)
+        exportBucketV5(bkt, bytes - e->bytesExported, pkts - e->pktExported);
+    else
+        exportBucketTemplate(t, bkt, bytes - e->bytesExported, pkts - e->pktExported);
+    e->bytesExported = bytes;
+    e->pktExported = pkts;
+    exported_flows++;
+}
+
+/*
+ * Drain the buckets each shard's owner lcore expired (see
+ * rte_table_netflow_expire), send their last deltas as v5 PDUs or packed
+ * v9/IPFIX messages, drop them from the snapshot, and give the buckets back
+ * to their shard. Must only be called from the export lcore, the single
+ * consumer of the export rings.
+ *
+ * Returns the number of flows expired.
+ */
+unsigned int netflow_export_poll(void)
+{
+    struct rte_table_netflow_snapshot *snap = probe.snapshot;
+    hashBucket_t *bkts[V5FLOWS_PER_PAK];
+    struct rte_table_netflow *t;
+    unsigned int s, n, i, total = 0;
+
+    exportTime();
+
+    for (s = 0; s < probe.nb_tables; s++) {
+        t = probe.table[s];
+        while ((n = rte_ring_sc_dequeue_burst(t->export_ring,
+                        (void **)bkts, V5FLOWS_PER_PAK, NULL)) > 0) {
+            if (snap != NULL && total == 0)
+                rte_table_snapshot_begin(snap);
+            for (i = 0; i < n; i++) {
+                if (exportEnabled)
+                    exportFlow(t, bkts[i]);
+                if (snap != NULL)
+                    rte_table_snapshot_clear(snap, s, t, bkts[i]);
             }
-       
-            rte_spinlock_unlock(&t->lock[i]);
-            /***********************************************************************
-             * End of entry lock
-             * release lock
-             **********************************************************************/
+            rte_table_netflow_bucket_put_bulk(t, bkts, n);
+            total += n;
         }
-        /* for each entry, check life time */
-        if (export_count > 0)
-            export_list = make_export(export_list);
+    }
 
-    } /* end of while */
+    if (snap != NULL && total > 0)
+        rte_table_snapshot_end(snap);
+    closeMsg();
+    if (exportQueued > 0)
+        netflow_export_flush();
 
+    return total;
+}
+
+static void exportDirty(struct rte_table_netflow *t, hashBucket_t *bkt, void *arg)
+{
+    unsigned int shard = *(unsigned int *)arg;
+
+    if (probe.snapshot != NULL)
+        rte_table_snapshot_update(probe.snapshot, shard, t, bkt);
+    if (exportEnabled)
+        exportFlow(t, bkt);
+    /* IPv4 shards: per second byte counts for elephant steering */
+    if (shard < probe.nb_workers)
+        netflow_offload_sample(shard, t, bkt);
+}
+
+/*
+ * Periodic export: walk the flows each shard updated since the last call
+ * (rte_table_netflow_dirty_walk), send their deltas and refresh their
+ * snapshot records. The cost follows the flows active in the period, not
+ * the flows held. Export lcore only.
+ *
+ * Returns the number of flows walked.
+ */
+unsigned int netflow_export_dirty(void)
+{
+    unsigned int s, total = 0;
+    int n;
+
+    exportTime();
+    if (probe.snapshot != NULL)
+        rte_table_snapshot_begin(probe.snapshot);
+
+    for (s = 0; s < probe.nb_tables; s++) {
+        n = rte_table_netflow_dirty_walk(probe.table[s], exportDirty, &s);
+        if (n > 0)
+            total += n;
+    }
+
+    if (probe.snapshot != NULL)
+        rte_table_snapshot_end(probe.snapshot);
+    closeMsg();
+    if (exportQueued > 0)
+        netflow_export_flush();
+
+    return total;
+}
+
+void netflow_export_print_stats(void)
+{
+    fprintf(stderr, "Flow records exported: %lu in %lu PDUs, %lu PDUs failed\n",
+            exported_flows, exported_pdus, send_errors);
+    if (skipped_v6_flows)
+        fprintf(stderr, "IPv6 flow records not exported (NetFlow v5): %lu\n",
+                skipped_v6_flows);
 }
@@ -0,0 +1,17 @@
+#ifndef __NETFLOW_EXPORT_H_
+#define __NETFLOW_EXPORT_H_
+
+#include <stdint.h>
+
+#define NETFLOW_EXPORT_BATCH        16      /* PDUs sent per sendmmsg() */
+#define NETFLOW_EXPORT_MSG_SIZE     1400    /* v9/IPFIX message size, fits a 1500 MTU */
+#define NETFLOW_TEMPLATE_REFRESH    64      /* v9/IPFIX messages between template resends */
+
+int netflow_export_init(const char *, int, uint8_t);
+int netflow_export_tx_setup(void);
+unsigned int netflow_export_poll(void);
+unsigned int netflow_export_dirty(void);
+void netflow_export_flush(void);
+void netflow_export_print_stats(void);
+
+#endif
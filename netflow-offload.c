@@ -0,0 +1,363 @@
+/*
+ * rte_flow rules for heavy flows, managed by the export lcore.
+ *
+ * MARK rules: the datapath offers the IPv4 flows that keep sending (see
+ * netflow_mark_offer) on a ring per shard; the controller installs a rule
+ * marking the flow's packets with its id, and removes it once the flow
+ * expired. Marked packets are accounted straight into their bucket,
+ * skipping parse and lookup.
+ *
+ * Steering rules: RSS may hash a few elephants onto one queue and leave its
+ * lcore behind while the others idle. The controller samples the rx ring
+ * occupancy of every lcore and, from the per second dirty walk, the byte
+ * counts of its flows; once a second it moves the heaviest flow of an lcore
+ * whose rings fill up to a queue of the least busy lcore, and drops rules
+ * of flows that slowed down. A moved flow starts a new record in the
+ * shard of its new lcore, the old one idles out.
+ *
+ * rte_flow calls are slow and may sleep, which is why they are made here
+ * and not on the datapath. Rules left at exit go with rte_flow_flush().
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_atomic.h>
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_ethdev.h>
+#include <rte_flow.h>
+#include <rte_malloc.h>
+#include <rte_ring.h>
+
+#include "netflow-offload.h"
+#include "probe.h"
+
+/* A flow seen at the steering rate in the last second */
+struct steer_cand {
+    union rte_table_netflow_key key;
+    uint64_t bytes;                             /**< 0 = none */
+    uint16_t port;
+};
+
+/* A flow sent to another lcore's queue */
+struct steer_rule {
+    union rte_table_netflow_key key;
+    struct rte_flow *flow;                      /**< NULL = unused entry */
+    uint16_t port, queue;
+    uint8_t slow_secs;                          /**< seconds in a row under half the rate */
+    uint8_t seen;                               /**< at half the rate or more this second */
+};
+
+static struct {
+    unsigned int nb_shards;                     /**< IPv4 shards with marks, probe.table[0..] */
+    struct rte_flow **rules[_MAX_LCORE];        /**< per shard and slot, NULL = none */
+    uint64_t n_installed;
+    uint64_t n_failed;
+    uint64_t n_removed;
+
+    unsigned int steer_max;                     /**< 0 = no steering */
+    uint64_t steer_bytes;                       /**< bytes per second of an elephant */
+    struct steer_cand cands[_MAX_LCORE][NETFLOW_STEER_CANDS];   /**< heaviest first */
+    struct steer_rule steer[NETFLOW_STEER_MAX];
+    unsigned int nb_steer;
+    unsigned int ring_peak[_MAX_LCORE];         /**< highest rx ring use this second, % */
+    uint64_t next_sample;                       /**< TSC of the next ring sample */
+    uint64_t n_steered;
+    uint64_t n_unsteered;
+    uint64_t n_steer_failed;
+} offload;
+
+/* The steering rule of a flow, or NULL */
+static struct steer_rule *
+steerFind(const union rte_table_netflow_key *key, uint16_t port)
+{
+    unsigned int i;
+
+    if (offload.nb_steer == 0)
+        return NULL;
+    for (i = 0; i < offload.steer_max; i++)
+        if (offload.steer[i].flow != NULL && offload.steer[i].port == port &&
+            _mm_movemask_epi8(_mm_cmpeq_epi8(offload.steer[i].key.xmm, key->xmm)) == 0xffff)
+            return &offload.steer[i];
+    return NULL;
+}
+
+/*
+ * Enable MARK rules on the IPv4 shards, max_rules in all, split evenly.
+ * Returns 0, or -1 if there is not room for one rule per shard.
+ */
+int
+netflow_offload_init(unsigned int max_rules)
+{
+    struct rte_table_netflow *t;
+    uint32_t n_slots;
+    unsigned int w;
+
+    n_slots = rte_align32prevpow2(max_rules / probe.nb_workers);
+    n_slots = RTE_MIN(n_slots, NETFLOW_MARK_MAX_SLOTS);
+    if (n_slots == 0)
+        return -1;
+
+    for (w = 0; w < probe.nb_workers; w++) {
+        t = probe.table[w];
+        offload.rules[w] = rte_zmalloc("NETFLOW_RULES", n_slots * sizeof(struct rte_flow *), 0);
+        if (offload.rules[w] == NULL ||
+            rte_table_netflow_mark_enable(t, w, n_slots,
+                    rte_lcore_to_socket_id(probe.l2p[w].lcore_id)) < 0)
+            return -1;
+    }
+    offload.nb_shards = probe.nb_workers;
+    printf(":: up to %u MARK rules per shard\n", n_slots);
+    return 0;
+}
+
+/* Keep the highest rx ring occupancy of every lcore, every NETFLOW_STEER_SAMPLE_US */
+static void
+steerSampleRings(void)
+{
+    uint64_t now = rte_rdtsc();
+    unsigned int w, i, pct;
+    int used;
+
+    if (now < offload.next_sample)
+        return;
+    offload.next_sample = now + rte_get_tsc_hz() / (1000000 / NETFLOW_STEER_SAMPLE_US);
+
+    for (w = 0; w < probe.nb_workers; w++) {
+        for (i = 0; i < probe.l2p[w].nb_rxq; i++) {
+            used = rte_eth_rx_queue_count(probe.l2p[w].rxq[i].port_id,
+                    probe.l2p[w].rxq[i].queue_id);
+            if (used <= 0)
+                continue;
+            pct = (unsigned int)used * 100 / probe.nb_rxd;
+            if (pct > offload.ring_peak[w])
+                offload.ring_peak[w] = pct;
+        }
+    }
+}
+
+/*
+ * Steer flows whose bytes per second reach rate_bps / 8, max_rules at
+ * most, off lcores whose rx rings fill up.
+ * Returns 0, or -1 if max_rules is 0.
+ */
+int
+netflow_offload_steer_init(unsigned int max_rules, uint64_t rate_bps)
+{
+    if (max_rules == 0)
+        return -1;
+    offload.steer_max = RTE_MIN(max_rules, (unsigned int)NETFLOW_STEER_MAX);
+    offload.steer_bytes = RTE_MAX(rate_bps / 8, (uint64_t)1);
+    printf(":: steering up to %u flows of %" PRIu64 " bytes/s or more\n",
+            offload.steer_max, offload.steer_bytes);
+    return 0;
+}
+
+/*
+ * A flow of IPv4 shard (and worker) w from the per second dirty walk: keep
+ * the heaviest ones and note steered flows still going strong. Export lcore
+ * only, as the bytes baseline is the exporter's.
+ */
+void
+netflow_offload_sample(unsigned int w, struct rte_table_netflow *t, hashBucket_t *bkt)
+{
+    hashBucket_cold_t *c;
+    hashBucket_exp_t *e;
+    struct steer_cand *cand = offload.cands[w];
+    struct steer_rule *r;
+    uint64_t bytes;
+    int i;
+
+    if (offload.steer_max == 0)
+        return;
+    c = rte_table_netflow_cold(t, bkt);
+    e = rte_table_netflow_exp(t, bkt);
+    bytes = bkt->bytesSent - e->bytesSampled;
+    e->bytesSampled = bkt->bytesSent;
+    /* packet sampling of the port counted 1/N of the bytes */
+    if (probe.sampling[c->port].mode == SAMPLE_DETERMINISTIC ||
+        probe.sampling[c->port].mode == SAMPLE_RANDOM)
+        bytes *= probe.sampling[c->port].rate;
+    if (bytes < offload.steer_bytes / 2)
+        return;
+
+    /* what generate_steer_flow() matches */
+    if (bkt->vlanId != 0 || bkt->tunnel != NETFLOW_TUNNEL_NONE ||
+        (bkt->proto != IPPROTO_TCP && bkt->proto != IPPROTO_UDP))
+        return;
+
+    r = steerFind((const union rte_table_netflow_key *)bkt, c->port);
+    if (r != NULL)
+        r->seen = 1;
+    if (bytes < offload.steer_bytes)
+        return;
+
+    for (i = NETFLOW_STEER_CANDS; i > 0 && cand[i - 1].bytes < bytes; i--)
+        if (i < NETFLOW_STEER_CANDS)
+            cand[i] = cand[i - 1];
+    if (i < NETFLOW_STEER_CANDS) {
+        cand[i].key.xmm = bkt->xmm;
+        cand[i].bytes = bytes;
+        cand[i].port = c->port;
+    }
+}
+
+/* A queue of port that lcore w polls, or -1 */
+static int
+steerQueue(unsigned int w, uint16_t port)
+{
+    unsigned int i;
+
+    for (i = 0; i < probe.l2p[w].nb_rxq; i++)
+        if (probe.l2p[w].rxq[i].port_id == port)
+            return probe.l2p[w].rxq[i].queue_id;
+    return -1;
+}
+
+/* Send a flow to queue, replacing its current steering rule if any */
+static void
+steerFlow(const struct steer_cand *cand, uint16_t queue)
+{
+    struct rte_flow_error error;
+    struct steer_rule *r;
+    unsigned int i;
+
+    r = steerFind(&cand->key, cand->port);
+    if (r != NULL) {
+        rte_flow_destroy(r->port, r->flow, &error);
+        r->flow = NULL;
+        offload.nb_steer--;
+    } else {
+        if (offload.nb_steer == offload.steer_max)
+            return;
+        for (i = 0; offload.steer[i].flow != NULL; i++)
+            ;
+        r = &offload.steer[i];
+    }
+
+    r->flow = generate_steer_flow(cand->port, queue, &cand->key, &error);
+    if (r->flow == NULL) {
+        offload.n_steer_failed++;
+        return;
+    }
+    r->key = cand->key;
+    r->port = cand->port;
+    r->queue = queue;
+    r->slow_secs = 0;
+    r->seen = 1;
+    offload.nb_steer++;
+    offload.n_steered++;
+}
+
+/*
+ * Once a second, after the dirty walk: drop the rules of flows that slowed
+ * down, then move the heaviest flow of each lcore falling behind to the
+ * least busy lcore, if that one has room. Export lcore only.
+ */
+void
+netflow_offload_balance(void)
+{
+    struct rte_flow_error error;
+    struct steer_rule *r;
+    unsigned int i, w, idle = 0;
+    int q;
+
+    if (offload.steer_max == 0)
+        return;
+
+    for (i = 0; i < offload.steer_max; i++) {
+        r = &offload.steer[i];
+        if (r->flow == NULL)
+            continue;
+        if (r->seen)
+            r->slow_secs = 0;
+        else if (++r->slow_secs >= NETFLOW_STEER_IDLE) {
+            rte_flow_destroy(r->port, r->flow, &error);
+            r->flow = NULL;
+            offload.nb_steer--;
+            offload.n_unsteered++;
+        }
+        r->seen = 0;
+    }
+
+    for (w = 1; w < probe.nb_workers; w++)
+        if (offload.ring_peak[w] < offload.ring_peak[idle])
+            idle = w;
+
+    for (w = 0; w < probe.nb_workers; w++) {
+        if (w == idle || offload.ring_peak[w] < NETFLOW_STEER_HIGH ||
+            offload.ring_peak[idle] > NETFLOW_STEER_LOW)
+            continue;
+        /* one flow per second and lcore, the rings tell if that was enough */
+        for (i = 0; i < NETFLOW_STEER_CANDS && offload.cands[w][i].bytes; i++) {
+            q = steerQueue(idle, offload.cands[w][i].port);
+            if (q >= 0) {
+                steerFlow(&offload.cands[w][i], q);
+                break;
+            }
+        }
+    }
+
+    memset(offload.cands, 0, sizeof(offload.cands));
+    memset(offload.ring_peak, 0, sizeof(offload.ring_peak));
+}
+
+/* Serve the rule requests of the shards, export lcore only */
+void
+netflow_offload_poll(void)
+{
+    void *reqs[NETFLOW_OFFLOAD_BURST];
+    struct rte_table_netflow_mark *mk;
+    struct rte_table_netflow *t;
+    struct rte_flow_error error;
+    struct rte_flow **rule;
+    unsigned int w, i, n;
+    uint32_t req, slot;
+
+    if (offload.steer_max)
+        steerSampleRings();
+
+    for (w = 0; w < offload.nb_shards; w++) {
+        t = probe.table[w];
+        n = rte_ring_sc_dequeue_burst(t->mark_ring, reqs, NETFLOW_OFFLOAD_BURST, NULL);
+        for (i = 0; i < n; i++) {
+            req = (uint32_t)(uintptr_t)reqs[i];
+            slot = req & ~NETFLOW_MARK_OP_DEL;
+            mk = &t->marks[slot];
+            rule = &offload.rules[w][slot];
+
+            if (req & NETFLOW_MARK_OP_DEL) {
+                if (*rule != NULL) {
+                    rte_flow_destroy(mk->port, *rule, &error);
+                    *rule = NULL;
+                    offload.n_removed++;
+                }
+                /* the owner may reuse the slot from here on */
+                rte_smp_wmb();
+                mk->state = NETFLOW_MARK_FREE;
+            } else if (mk->state == NETFLOW_MARK_ACTIVE &&
+                       steerFind(&mk->key, mk->port) == NULL) {
+                /* a flow already gone has its removal queued behind; a
+                 * steered flow's rule would be shadowed by the steering one */
+                *rule = generate_mark_flow(mk->port, mk->queue, &mk->key, mk->id, &error);
+                if (*rule != NULL)
+                    offload.n_installed++;
+                else
+                    offload.n_failed++;
+            }
+        }
+    }
+}
+
+void
+netflow_offload_print_stats(void)
+{
+    if (offload.nb_shards != 0)
+        printf("\nMARK rules: %lu installed, %lu removed, %lu refused by the NIC\n",
+                offload.n_installed, offload.n_removed, offload.n_failed);
+    if (offload.steer_max != 0)
+        printf("\nSteering rules: %lu installed, %lu removed, %lu refused by the NIC\n",
+                offload.n_steered, offload.n_unsteered, offload.n_steer_failed);
+}
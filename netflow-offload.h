@@ -0,0 +1,26 @@
+#ifndef __NETFLOW_OFFLOAD_H_
+#define __NETFLOW_OFFLOAD_H_
+
+#include <stdint.h>
+
+#include "rte_table_netflow.h"
+
+#define NETFLOW_OFFLOAD_BURST       32          /* rule requests served per shard and poll */
+
+#define NETFLOW_STEER_MAX           256         /* steering rules at most */
+#define NETFLOW_STEER_CANDS         4           /* heaviest flows kept per lcore and second */
+#define NETFLOW_STEER_SAMPLE_US     10000       /* rx ring occupancy sampling period */
+#define NETFLOW_STEER_HIGH          50          /* % of the rx ring used: the lcore is behind */
+#define NETFLOW_STEER_LOW           25          /* % of the rx ring used: the lcore has room */
+#define NETFLOW_STEER_IDLE          5           /* seconds under half the rate before a rule goes */
+
+struct rte_table_netflow;
+
+int netflow_offload_init(unsigned int);
+int netflow_offload_steer_init(unsigned int, uint64_t);
+void netflow_offload_poll(void);
+void netflow_offload_sample(unsigned int, struct rte_table_netflow *, hashBucket_t *);
+void netflow_offload_balance(void);
+void netflow_offload_print_stats(void);
+
+#endif
@@ -0,0 +1,135 @@
+/*
+ * Reader of the binary flow snapshot kept by rte_table_snapshot_update()
+ * and rte_table_snapshot_clear(), see netflow-snapshot.h. Plain libc, no
+ * DPDK.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "netflow-snapshot.h"
+
+#define NETFLOW_SNAP_RETRIES    100
+
+/* Map a snapshot file read-only and check its header */
+int
+netflow_snap_open(struct netflow_snap *s, const char *path)
+{
+    struct stat st;
+    void *map;
+
+    memset(s, 0, sizeof(*s));
+    s->fd = open(path, O_RDONLY);
+    if (s->fd < 0)
+        return -errno;
+    if (fstat(s->fd, &st) < 0 || (size_t)st.st_size < sizeof(struct netflow_snap_hdr)) {
+        close(s->fd);
+        return -EINVAL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, s->fd, 0);
+    if (map == MAP_FAILED) {
+        close(s->fd);
+        return -errno;
+    }
+    s->map_size = st.st_size;
+    s->hdr = map;
+    s->recs = (const struct netflow_snap_rec *)(s->hdr + 1);
+
+    if (s->hdr->magic != NETFLOW_SNAP_MAGIC ||
+        s->hdr->version != NETFLOW_SNAP_VERSION ||
+        s->hdr->rec_size != sizeof(struct netflow_snap_rec) ||
+        sizeof(*s->hdr) + s->hdr->capacity * sizeof(struct netflow_snap_rec) > s->map_size) {
+        netflow_snap_close(s);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+void
+netflow_snap_close(struct netflow_snap *s)
+{
+    if (s->hdr != NULL)
+        munmap((void *)s->hdr, s->map_size);
+    if (s->fd >= 0)
+        close(s->fd);
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+}
+
+/*
+ * Copy a consistent snapshot: the header into *hdr and up to max records
+ * into recs. Retries while the writer is rewriting the file.
+ *
+ * Returns the number of records copied, or -1 if no stable copy was had.
+ */
+long
+netflow_snap_read(const struct netflow_snap *s, struct netflow_snap_hdr *hdr,
+        struct netflow_snap_rec *recs, uint64_t max)
+{
+    uint64_t seq, n;
+    int i;
+
+    for (i = 0; i < NETFLOW_SNAP_RETRIES; i++) {
+        seq = s->hdr->seq;
+        if (seq & 1) {
+            usleep(1000);
+            continue;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        memcpy(hdr, s->hdr, sizeof(*hdr));
+        n = hdr->n_records < max ? hdr->n_records : max;
+        memcpy(recs, s->recs, n * sizeof(*recs));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (s->hdr->seq == seq)
+            return n;
+    }
+    return -1;
+}
+
+/* Milliseconds since the epoch of a flow timestamp */
+uint64_t
+netflow_snap_ms(const struct netflow_snap_hdr *hdr, uint64_t tsc)
+{
+    return hdr->time_base_ns / 1000000 +
+        (int64_t)((double)(int64_t)(tsc - hdr->tsc_base) * 1000 / hdr->tsc_hz);
+}
+
+/* Print used records as "src,dst,sport,dport,proto,bytes,pkts,first_ms,last_ms" lines */
+int
+netflow_snap_write_csv(const struct netflow_snap_hdr *hdr,
+        const struct netflow_snap_rec *recs, uint64_t n, FILE *out)
+{
+    char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    const struct netflow_snap_rec *r;
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        r = &recs[i];
+        if (r->pkts == 0)
+            continue;
+        if (r->family == 6) {
+            inet_ntop(AF_INET6, r->ip6_src, src, sizeof(src));
+            inet_ntop(AF_INET6, r->ip6_dst, dst, sizeof(dst));
+        } else {
+            inet_ntop(AF_INET, &r->ip_src, src, sizeof(src));
+            inet_ntop(AF_INET, &r->ip_dst, dst, sizeof(dst));
+        }
+        if (fprintf(out, "%s,%s,%u,%u,%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                    src, dst, ntohs(r->port_src), ntohs(r->port_dst), r->proto,
+                    r->bytes, r->pkts,
+                    netflow_snap_ms(hdr, r->first_tsc),
+                    netflow_snap_ms(hdr, r->last_tsc)) < 0)
+            return -1;
+    }
+    return 0;
+}
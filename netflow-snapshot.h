@@ -0,0 +1,90 @@
+#ifndef __NETFLOW_SNAPSHOT_H_
+#define __NETFLOW_SNAPSHOT_H_
+
+/**
+ * @file
+ * Binary flow snapshot
+ *
+ * The export lcore keeps every live flow in a preallocated, memory-mapped
+ * file: a fixed header followed by an array of fixed-width records, one
+ * per flow table bucket. Once a second it rewrites the records of the
+ * flows that changed, and it empties (zeroes) the records of expired
+ * flows; records with pkts == 0 are unused. The header carries a sequence
+ * counter that is odd while records change, so readers copy the records
+ * out and retry until they got a stable copy (netflow_snap_read).
+ *
+ * Flow timestamps are raw TSC values; the header carries what it takes to
+ * turn them into wall clock time (netflow_snap_ms).
+ *
+ * This header does not depend on DPDK, so tools can read snapshots.
+ ***/
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NETFLOW_SNAP_MAGIC      0x50414e53574c464eULL  /* "NFLWSNAP" */
+#define NETFLOW_SNAP_VERSION    4
+
+struct netflow_snap_hdr {
+    uint64_t magic;                 /**< NETFLOW_SNAP_MAGIC */
+    uint32_t version;               /**< NETFLOW_SNAP_VERSION */
+    uint32_t rec_size;              /**< sizeof(struct netflow_snap_rec) */
+    uint64_t capacity;              /**< records the file has room for */
+    volatile uint64_t seq;          /**< odd while the writer fills the file */
+    uint64_t n_records;             /**< records in use or not, = capacity */
+    uint64_t snap_tsc;              /**< TSC of the last change */
+    uint64_t tsc_hz;
+    uint64_t tsc_base;              /**< TSC at time_base_ns */
+    uint64_t time_base_ns;          /**< wall clock at tsc_base, ns since the epoch */
+    uint64_t reserved[7];
+};
+
+/* One flow, 96 bytes */
+struct netflow_snap_rec {
+    uint32_t ip_src;                /**< network order, family 4 */
+    uint32_t ip_dst;                /**< network order, family 4 */
+    uint16_t port_src;              /**< network order */
+    uint16_t port_dst;              /**< network order */
+    uint8_t  proto;
+    uint8_t  tos;
+    uint8_t  tcp_flags;
+    uint8_t  shard;                 /**< flow table shard, IPv6 ones after the IPv4 ones */
+    uint16_t vlan;                  /**< VLAN id, or folded tun_id if tunnel */
+    uint8_t  family;                /**< 4 or 6, of the inner header if tunnel */
+    uint8_t  tunnel;                /**< NETFLOW_TUNNEL_*, 0 = none */
+    uint32_t tun_id;                /**< VNI, GRE key or GTP-U TEID, if tunnel */
+    uint64_t bytes;
+    uint64_t pkts;
+    uint64_t first_tsc;
+    uint64_t last_tsc;
+    uint8_t  ip6_src[16];           /**< family 6 */
+    uint8_t  ip6_dst[16];           /**< family 6 */
+    uint32_t tun_src;               /**< outer IPv4 endpoints, network order, if tunnel */
+    uint32_t tun_dst;
+};
+
+/* Reader side, see netflow-snapshot.c */
+struct netflow_snap {
+    int fd;
+    size_t map_size;
+    const struct netflow_snap_hdr *hdr;
+    const struct netflow_snap_rec *recs;
+};
+
+int netflow_snap_open(struct netflow_snap *, const char *);
+void netflow_snap_close(struct netflow_snap *);
+long netflow_snap_read(const struct netflow_snap *, struct netflow_snap_hdr *,
+        struct netflow_snap_rec *, uint64_t);
+uint64_t netflow_snap_ms(const struct netflow_snap_hdr *, uint64_t);
+int netflow_snap_write_csv(const struct netflow_snap_hdr *,
+        const struct netflow_snap_rec *, uint64_t, FILE *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * Top talkers, reported by the export lcore from the heavy hitter
+ * sketches of the shards.
+ *
+ * Every packet a shard sees goes into its sketch, whether the table has
+ * room for its flow or not, so the report still names the heaviest flows
+ * when the table is full of one-packet flows, as in a flood. Once a second
+ * the shards switch sketch banks; the closed banks of each address family
+ * are summed into one count-min sketch, the keys they kept are looked up
+ * in the sum, and the heaviest ones are written to a text file, replaced
+ * as a whole so readers never see half a report.
+ *
+ * Packet counts are count-min estimates over the last second: never low,
+ * and high by at most a small share of all the packets of the family.
+ * Byte counts only cover the time the key was among the heaviest of its
+ * shard, a lower bound.
+ */
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <rte_common.h>
+
+#include "netflow-topn.h"
+#include "probe.h"
+
+/* A key kept by at least one shard, with its estimate in the sum */
+struct topn_cand {
+    union rte_table_netflow_key key;
+    struct rte_table_netflow_addr6 addr6;       /**< family 6 */
+    uint64_t bytes;
+    uint32_t pkts;
+    uint8_t family;
+};
+
+static struct {
+    unsigned int n;                             /**< talkers reported, 0 = off */
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    struct rte_table_netflow_sketch_bank sum[2];    /**< counters of all shards, per family */
+    struct topn_cand cands[2 * _MAX_LCORE * NETFLOW_SKETCH_TOPK];
+    unsigned int nb_cands;
+    uint64_t n_pkts[2];                         /**< packets counted, per family */
+    uint64_t n_reports;
+    uint64_t n_missed;                          /**< shards that did not switch banks in time */
+} topn;
+
+/* Add the counters of a closed bank to the sum of its family, 8 at a time */
+static void
+topnSum(struct rte_table_netflow_sketch_bank *sum, const struct rte_table_netflow_sketch_bank *b)
+{
+    __m128i *d = (__m128i *)&sum->cm[0][0];
+    const __m128i *s = (const __m128i *)&b->cm[0][0];
+    unsigned int i;
+
+    for (i = 0; i < sizeof(b->cm) / sizeof(__m128i); i += 2) {
+        d[i] = _mm_add_epi32(d[i], s[i]);
+        d[i + 1] = _mm_add_epi32(d[i + 1], s[i + 1]);
+    }
+}
+
+/* Merge the keys a shard kept into the candidates, once per key */
+static void
+topnCollect(const struct rte_table_netflow_sketch_bank *b, uint8_t family)
+{
+    const struct rte_table_netflow_topk *e;
+    struct topn_cand *c;
+    unsigned int i, j;
+
+    for (i = 0; i < b->n_top; i++) {
+        e = &b->top[i];
+        for (j = 0; j < topn.nb_cands; j++) {
+            c = &topn.cands[j];
+            /* IPv6 keys hold folded addresses, the full ones decide */
+            if (c->family == family &&
+                _mm_movemask_epi8(_mm_cmpeq_epi8(c->key.xmm, e->key.xmm)) == 0xffff &&
+                (family != 6 || memcmp(&c->addr6, &e->addr6, sizeof(c->addr6)) == 0))
+                break;
+        }
+        if (j == topn.nb_cands) {
+            c = &topn.cands[topn.nb_cands++];
+            c->key.xmm = e->key.xmm;
+            c->addr6 = e->addr6;
+            c->bytes = 0;
+            c->family = family;
+        }
+        topn.cands[j].bytes += e->bytes;
+    }
+}
+
+static int
+topnCompare(const void *a, const void *b)
+{
+    const struct topn_cand *x = a, *y = b;
+
+    return (x->pkts < y->pkts) - (x->pkts > y->pkts);
+}
+
+/* "address:port" of one side of a candidate */
+static void
+topnEndpoint(char *buf, size_t len, const struct topn_cand *c, int dst)
+{
+    char addr[INET6_ADDRSTRLEN];
+    uint16_t port = rte_be_to_cpu_16(dst ? c->key.port_dst : c->key.port_src);
+
+    if (c->family == 6) {
+        inet_ntop(AF_INET6, dst ? c->addr6.dst : c->addr6.src, addr, sizeof(addr));
+        snprintf(buf, len, "[%s]:%u", addr, port);
+    } else {
+        inet_ntop(AF_INET, dst ? &c->key.ip_dst : &c->key.ip_src, addr, sizeof(addr));
+        snprintf(buf, len, "%s:%u", addr, port);
+    }
+}
+
+static void
+topnWrite(unsigned int n)
+{
+    char src[INET6_ADDRSTRLEN + 8], dst[INET6_ADDRSTRLEN + 8];
+    const struct topn_cand *c;
+    unsigned int i;
+    FILE *f;
+
+    f = fopen(topn.tmp, "w");
+    if (f == NULL)
+        return;
+    fprintf(f, "# top talkers of the last second, of %" PRIu64 " IPv4 and %" PRIu64
+            " IPv6 packets\n# rank pkts bytes proto src dst tunnel\n",
+            topn.n_pkts[0], topn.n_pkts[1]);
+    for (i = 0; i < n; i++) {
+        c = &topn.cands[i];
+        topnEndpoint(src, sizeof(src), c, 0);
+        topnEndpoint(dst, sizeof(dst), c, 1);
+        fprintf(f, "%u %u %" PRIu64 " %u %s %s %u\n", i + 1, c->pkts, c->bytes,
+                c->key.proto, src, dst, c->key.tunnel);
+    }
+    if (fclose(f) == 0 && rename(topn.tmp, topn.path) == 0)
+        topn.n_reports++;
+}
+
+/*
+ * Report the n heaviest flows to path every second: give every shard a
+ * heavy hitter sketch. Returns 0, or -1 if one could not be allocated.
+ */
+int
+netflow_topn_init(unsigned int n, const char *path)
+{
+    unsigned int s, w;
+
+    for (s = 0; s < probe.nb_tables; s++) {
+        w = s % probe.nb_workers;
+        if (rte_table_netflow_sketch_enable(probe.table[s],
+                rte_lcore_to_socket_id(probe.l2p[w].lcore_id)) < 0)
+            return -1;
+    }
+    topn.n = RTE_MIN(n, (unsigned int)NETFLOW_TOPN_MAX);
+    snprintf(topn.path, sizeof(topn.path), "%s", path);
+    snprintf(topn.tmp, sizeof(topn.tmp), "%s.tmp", path);
+    printf(":: top %u talkers to %s\n", topn.n, topn.path);
+    return 0;
+}
+
+/* Once a second, on the export lcore */
+void
+netflow_topn_report(void)
+{
+    const struct rte_table_netflow_sketch_bank *b;
+    unsigned int s, i;
+    uint8_t f;
+
+    if (topn.n == 0)
+        return;
+
+    memset(topn.sum[0].cm, 0, sizeof(topn.sum[0].cm));
+    memset(topn.sum[1].cm, 0, sizeof(topn.sum[1].cm));
+    topn.n_pkts[0] = topn.n_pkts[1] = 0;
+    topn.nb_cands = 0;
+    for (s = 0; s < probe.nb_tables; s++) {
+        b = rte_table_netflow_sketch_close(probe.table[s]);
+        if (b == NULL) {
+            topn.n_missed++;
+            continue;
+        }
+        f = (probe.table[s]->addr6 != NULL);
+        topnSum(&topn.sum[f], b);
+        topnCollect(b, f ? 6 : 4);
+        topn.n_pkts[f] += b->n_pkts;
+        rte_table_netflow_sketch_release(probe.table[s]);
+    }
+
+    for (i = 0; i < topn.nb_cands; i++)
+        topn.cands[i].pkts = rte_table_netflow_sketch_estimate(
+                &topn.sum[topn.cands[i].family == 6], &topn.cands[i].key);
+    qsort(topn.cands, topn.nb_cands, sizeof(topn.cands[0]), topnCompare);
+    topnWrite(RTE_MIN(topn.n, topn.nb_cands));
+}
+
+void
+netflow_topn_print_stats(void)
+{
+    if (topn.n != 0)
+        printf("\nTop talkers: %" PRIu64 " reports written, %" PRIu64 " shards late\n",
+                topn.n_reports, topn.n_missed);
+}
@@ -0,0 +1,12 @@
+#ifndef __NETFLOW_TOPN_H_
+#define __NETFLOW_TOPN_H_
+
+#include <stdint.h>
+
+#define NETFLOW_TOPN_MAX            64          /* talkers reported at most */
+
+int netflow_topn_init(unsigned int, const char *);
+void netflow_topn_report(void);
+void netflow_topn_print_stats(void);
+
+#endif
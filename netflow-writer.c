@@ -0,0 +1,367 @@
+/*
+ * Export file writer. The export lcore appends the PDUs it sends to the
+ * collector into large buffers; full buffers are handed over on a ring and
+ * written to files under a directory, rotated by size and age:
+ *
+ *   DIR/netflow-000000.dat, DIR/netflow-000001.dat, ...
+ *
+ * Producers never block: with io_uring the export lcore submits the writes
+ * and reaps them from netflow_writer_poll() without waiting, and the next
+ * file is opened ahead of time through the ring too. Without io_uring (not
+ * built in, or the kernel refuses it) a writer thread does plain writes.
+ * Either way, when the disk is slow or full the buffers run out and new
+ * data is dropped and counted instead of backing up the export path.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_malloc.h>
+#include <rte_ring.h>
+
+#ifdef NETFLOW_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "netflow-writer.h"
+
+struct netflow_wbuf {
+    uint32_t len;
+    uint8_t data[NETFLOW_WRITER_BUF_SIZE];
+};
+
+#define WRITER_TAG_OPEN     1                   /* user_data of non-write SQEs */
+#define WRITER_TAG_CLOSE    2
+#define WRITER_IDLE_US      1000                /* writer thread nap when idle */
+#define WRITER_STOP_MS      5000                /* wait for in flight writes at exit */
+
+static struct {
+    int enabled;
+    char dir[PATH_MAX];
+    uint64_t rotate_bytes;
+    uint64_t rotate_tsc;
+
+    struct netflow_wbuf *bufs;
+    struct netflow_wbuf *cur;                   /**< being filled, producer only */
+    struct rte_ring *full_ring;                 /**< producer to writer */
+    struct rte_ring *free_ring;                 /**< writer back to producer */
+
+    int fd;
+    uint64_t off;                               /**< bytes written to fd so far */
+    uint64_t opened_tsc;
+    uint32_t file_seq;
+
+    uint64_t n_bytes, n_files, n_dropped, n_errors;
+
+    int use_uring;
+#ifdef NETFLOW_HAVE_LIBURING
+    struct io_uring ring;
+    int next_fd;                                /**< opened ahead, < 0 if none */
+    int open_pending;                           /**< opening next_fd is in the ring */
+    char next_path[PATH_MAX];
+    unsigned int inflight;
+#endif
+    pthread_t thread;
+    volatile int stop;
+} writer = { .fd = -1 };
+
+static void writerPath(char *path)
+{
+    snprintf(path, PATH_MAX, "%s/netflow-%06u.dat", writer.dir, writer.file_seq++);
+}
+
+static int writerRotateDue(uint32_t len)
+{
+    return writer.fd < 0 || (writer.off > 0 &&
+            (writer.off + len > writer.rotate_bytes ||
+             rte_rdtsc() - writer.opened_tsc > writer.rotate_tsc));
+}
+
+static void writerRecycle(struct netflow_wbuf *b)
+{
+    b->len = 0;
+    rte_ring_sp_enqueue(writer.free_ring, b);
+}
+
+/* Blocking path: the writer thread owns the files */
+static void *writerThread(__attribute__((unused)) void *arg)
+{
+    char path[PATH_MAX];
+    struct netflow_wbuf *b;
+    ssize_t w;
+    uint32_t done;
+
+    for (;;) {
+        if (rte_ring_sc_dequeue(writer.full_ring, (void **)&b) != 0) {
+            if (writer.stop)
+                break;
+            usleep(WRITER_IDLE_US);
+            continue;
+        }
+
+        if (writerRotateDue(b->len)) {
+            if (writer.fd >= 0)
+                close(writer.fd);
+            writerPath(path);
+            writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            writer.off = 0;
+            writer.opened_tsc = rte_rdtsc();
+            if (writer.fd >= 0)
+                writer.n_files++;
+        }
+
+        for (done = 0; writer.fd >= 0 && done < b->len; done += w) {
+            w = write(writer.fd, b->data + done, b->len - done);
+            if (w <= 0) {
+                if (w < 0 && errno == EINTR) {
+                    w = 0;
+                    continue;
+                }
+                break;
+            }
+        }
+        if (done < b->len)
+            writer.n_errors++;
+        writer.off += done;
+        writer.n_bytes += done;
+        writerRecycle(b);
+    }
+
+    if (writer.fd >= 0)
+        close(writer.fd);
+    writer.fd = -1;
+    return NULL;
+}
+
+#ifdef NETFLOW_HAVE_LIBURING
+/* Open the file after the current one through the ring */
+static void writerUringOpenNext(void)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&writer.ring);
+
+    if (sqe == NULL)
+        return;
+    writerPath(writer.next_path);
+    io_uring_prep_openat(sqe, AT_FDCWD, writer.next_path,
+            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    io_uring_sqe_set_data64(sqe, WRITER_TAG_OPEN);
+    writer.next_fd = -1;
+    writer.open_pending = 1;
+}
+
+static void writerUringReap(void)
+{
+    struct io_uring_cqe *cqe;
+    uint64_t tag;
+
+    while (io_uring_peek_cqe(&writer.ring, &cqe) == 0) {
+        tag = io_uring_cqe_get_data64(cqe);
+        if (tag == WRITER_TAG_OPEN) {
+            writer.open_pending = 0;
+            writer.next_fd = cqe->res;
+            if (cqe->res < 0)
+                writer.n_errors++;
+        } else if (tag != WRITER_TAG_CLOSE) {
+            struct netflow_wbuf *b = (struct netflow_wbuf *)(uintptr_t)tag;
+
+            if (cqe->res < 0 || (uint32_t)cqe->res < b->len)
+                writer.n_errors++;
+            if (cqe->res > 0)
+                writer.n_bytes += cqe->res;
+            writerRecycle(b);
+            writer.inflight--;
+        }
+        io_uring_cqe_seen(&writer.ring, cqe);
+    }
+}
+
+static void writerUringSubmit(void)
+{
+    struct io_uring_sqe *sqe;
+    struct netflow_wbuf *b;
+    unsigned int queued = 0;
+
+    while (writer.inflight < NETFLOW_WRITER_QD &&
+           io_uring_sq_space_left(&writer.ring) >= 3 &&
+           rte_ring_sc_dequeue(writer.full_ring, (void **)&b) == 0) {
+        /* switch to the file opened ahead, or keep going if it is not there yet */
+        if (writerRotateDue(b->len) && !writer.open_pending && writer.next_fd >= 0) {
+            if (writer.fd >= 0) {
+                sqe = io_uring_get_sqe(&writer.ring);
+                io_uring_prep_close(sqe, writer.fd);
+                io_uring_sqe_set_data64(sqe, WRITER_TAG_CLOSE);
+            }
+            writer.fd = writer.next_fd;
+            writer.off = 0;
+            writer.opened_tsc = rte_rdtsc();
+            writer.n_files++;
+            writerUringOpenNext();
+        } else if (!writer.open_pending && writer.next_fd < 0) {
+            /* opening ahead failed, or found no room in the ring: try again */
+            writerUringOpenNext();
+        }
+
+        if (writer.fd < 0) {
+            writer.n_errors++;
+            writerRecycle(b);
+            continue;
+        }
+        sqe = io_uring_get_sqe(&writer.ring);
+        io_uring_prep_write(sqe, writer.fd, b->data, b->len, writer.off);
+        io_uring_sqe_set_data64(sqe, (uintptr_t)b);
+        writer.off += b->len;
+        writer.inflight++;
+        queued++;
+    }
+
+    if (queued || io_uring_sq_ready(&writer.ring))
+        io_uring_submit(&writer.ring);
+}
+#endif
+
+/*
+ * Write export PDUs under dir, in a new file every rotate_bytes bytes or
+ * rotate_secs seconds.
+ */
+int netflow_writer_init(const char *dir, uint64_t rotate_bytes, unsigned int rotate_secs)
+{
+    unsigned int i;
+
+    snprintf(writer.dir, sizeof(writer.dir), "%s", dir);
+    writer.rotate_bytes = rotate_bytes;
+    writer.rotate_tsc = rotate_secs * rte_get_tsc_hz();
+
+    writer.bufs = rte_malloc("NETFLOW_WRITER",
+            NETFLOW_WRITER_BUFS * sizeof(struct netflow_wbuf), RTE_CACHE_LINE_SIZE);
+    writer.full_ring = rte_ring_create("NETFLOW_WRITER_FULL", rte_align32pow2(NETFLOW_WRITER_BUFS + 1),
+            SOCKET_ID_ANY, RING_F_SP_ENQ | RING_F_SC_DEQ);
+    writer.free_ring = rte_ring_create("NETFLOW_WRITER_FREE", rte_align32pow2(NETFLOW_WRITER_BUFS + 1),
+            SOCKET_ID_ANY, RING_F_SP_ENQ | RING_F_SC_DEQ);
+    if (writer.bufs == NULL || writer.full_ring == NULL || writer.free_ring == NULL) {
+        printf("cannot allocate the export writer buffers\n");
+        return -1;
+    }
+    for (i = 0; i < NETFLOW_WRITER_BUFS; i++)
+        writerRecycle(&writer.bufs[i]);
+
+#ifdef NETFLOW_HAVE_LIBURING
+    if (io_uring_queue_init(2 * NETFLOW_WRITER_QD, &writer.ring, 0) == 0) {
+        char path[PATH_MAX];
+
+        writerPath(path);
+        writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (writer.fd < 0) {
+            printf("cannot open %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        writer.opened_tsc = rte_rdtsc();
+        writer.n_files++;
+        writer.next_fd = -1;
+        writerUringOpenNext();
+        io_uring_submit(&writer.ring);
+        writer.use_uring = 1;
+    }
+#endif
+    if (!writer.use_uring &&
+        pthread_create(&writer.thread, NULL, writerThread, NULL) != 0) {
+        printf("cannot start the export writer thread\n");
+        return -1;
+    }
+
+    writer.enabled = 1;
+    printf(":: writing export files to %s (%s)\n", dir,
+           writer.use_uring ? "io_uring" : "writer thread");
+    return 0;
+}
+
+int netflow_writer_enabled(void)
+{
+    return writer.enabled;
+}
+
+/* Hand the buffer being filled to the writer */
+void netflow_writer_flush(void)
+{
+    if (writer.cur == NULL || writer.cur->len == 0)
+        return;
+    rte_ring_sp_enqueue(writer.full_ring, writer.cur);
+    writer.cur = NULL;
+}
+
+/*
+ * Copy len bytes into the current buffer. Never blocks: without a free
+ * buffer the data is dropped. Export lcore only.
+ */
+int netflow_writer_append(const void *data, uint32_t len)
+{
+    if (writer.cur != NULL && writer.cur->len + len > NETFLOW_WRITER_BUF_SIZE)
+        netflow_writer_flush();
+    if (writer.cur == NULL &&
+        rte_ring_sc_dequeue(writer.free_ring, (void **)&writer.cur) != 0) {
+        writer.cur = NULL;
+        writer.n_dropped += len;
+        return -1;
+    }
+
+    memcpy(writer.cur->data + writer.cur->len, data, len);
+    writer.cur->len += len;
+    return 0;
+}
+
+/* Submit and reap io_uring writes, from the export lcore loop */
+void netflow_writer_poll(void)
+{
+#ifdef NETFLOW_HAVE_LIBURING
+    if (writer.use_uring) {
+        writerUringReap();
+        writerUringSubmit();
+    }
+#endif
+}
+
+/* Write out what is buffered, waiting a bounded time, and close the files */
+void netflow_writer_stop(void)
+{
+    if (!writer.enabled || writer.stop)
+        return;
+    netflow_writer_flush();
+
+#ifdef NETFLOW_HAVE_LIBURING
+    if (writer.use_uring) {
+        unsigned int ms;
+
+        for (ms = 0; ms < WRITER_STOP_MS; ms++) {
+            netflow_writer_poll();
+            if (writer.inflight == 0 && !writer.open_pending &&
+                rte_ring_count(writer.full_ring) == 0)
+                break;
+            rte_delay_ms(1);
+        }
+        if (writer.fd >= 0)
+            close(writer.fd);
+        if (writer.next_fd >= 0)
+            close(writer.next_fd);
+        io_uring_queue_exit(&writer.ring);
+    }
+#endif
+    writer.stop = 1;
+    if (!writer.use_uring)
+        pthread_join(writer.thread, NULL);
+}
+
+void netflow_writer_print_stats(void)
+{
+    if (!writer.enabled)
+        return;
+    fprintf(stderr, "Export files: %lu bytes in %lu files, %lu bytes dropped, %lu errors\n",
+            writer.n_bytes, writer.n_files, writer.n_dropped, writer.n_errors);
+}
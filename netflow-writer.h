@@ -0,0 +1,18 @@
+#ifndef __NETFLOW_WRITER_H_
+#define __NETFLOW_WRITER_H_
+
+#include <stdint.h>
+
+#define NETFLOW_WRITER_BUFS         32          /* buffers, filled or in flight */
+#define NETFLOW_WRITER_BUF_SIZE     (1 << 20)
+#define NETFLOW_WRITER_QD           16          /* io_uring writes in flight */
+
+int netflow_writer_init(const char *, uint64_t, unsigned int);
+int netflow_writer_enabled(void);
+int netflow_writer_append(const void *, uint32_t);
+void netflow_writer_flush(void);
+void netflow_writer_poll(void);
+void netflow_writer_stop(void);
+void netflow_writer_print_stats(void);
+
+#endif
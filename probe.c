@@ -34,36 +34,343 @@
 
 
 extern probe_t  probe;
-static struct rte_table_netflow *table_ref;
+static RTE_DEFINE_PER_LCORE(struct rte_table_netflow *, table_ref);
+static RTE_DEFINE_PER_LCORE(struct rte_table_netflow *, table6_ref);
+
+/* Per lcore sampling state: packets to skip before the next deterministic
+ * sample of each port, and the xorshift state of the random mode */
+static RTE_DEFINE_PER_LCORE(uint16_t, sample_skip[_RTE_MAX_ETHPORTS]);
+static RTE_DEFINE_PER_LCORE(uint64_t, sample_rand);
 
 // Allocate the netflow structure for global use
 
 volatile    int quit = 0;
 
+#define ETHER_TYPE_VLAN_9100    0x9100  /* pre 802.1ad QinQ outer tag */
+#define L2_MAX_VLAN_TAGS        2
+#define L2_MAX_MPLS_LABELS      4
+#define MPLS_BOTTOM_OF_STACK    0x100   /* in the host order label entry */
+
+static __inline__ int
+is_vlan_type(uint16_t type)
+{
+    return type == rte_cpu_to_be_16(ETHER_TYPE_VLAN) ||
+           type == rte_cpu_to_be_16(ETHER_TYPE_QINQ) ||
+           type == rte_cpu_to_be_16(ETHER_TYPE_VLAN_9100);
+}
+
 /**************************************************************************//**
 *
 * packet_type - Examine a packet and return the type of packet
 *
 * DESCRIPTION
-* Examine a packet and return the type of packet.
-* the packet.
+* Examine a packet and return the type of its L3 header, walking up to two
+* VLAN tags and an MPLS label stack. *l3 is set to the L3 header and *vlan
+* to the innermost VLAN id, 0 when untagged. Tags the NIC stripped are
+* taken from the mbuf, so an untagged or stripped frame costs a single
+* compare. A label stack is followed by IPv4 or IPv6, told apart by the
+* version nibble.
 *
-* RETURNS: N/A
+* RETURNS: the host order ethertype, UNKNOWN_PACKET if it runs past the
+* segment or the label stack does not end.
 *
-* SEE ALSO:
+* SEE ALSO: l2_walk
 */
 
+/* Walk the tags and labels following an Ethernet header, whose network
+ * order ethertype is type and whose payload starts at p */
+static __inline__ pktType_e
+l2_walk(uint8_t *p, const uint8_t *end, uint16_t type, uint8_t **l3, uint16_t *vlan)
+{
+    uint32_t label;
+    int i;
+
+    for (i = 0; i < L2_MAX_VLAN_TAGS && is_vlan_type(type); i++) {
+        struct vlan_hdr *vh = (struct vlan_hdr *)p;
+
+        if (p + sizeof(*vh) > end)
+            return UNKNOWN_PACKET;
+        *vlan = rte_be_to_cpu_16(vh->vlan_tci) & 0xfff;
+        type = vh->eth_proto;
+        p += sizeof(*vh);
+    }
+
+    if (unlikely(type == rte_cpu_to_be_16(ETHER_TYPE_MPLS) ||
+                 type == rte_cpu_to_be_16(ETHER_TYPE_MPLSM))) {
+        for (i = 0; i < L2_MAX_MPLS_LABELS; i++) {
+            if (p + sizeof(label) + 1 > end)
+                return UNKNOWN_PACKET;
+            memcpy(&label, p, sizeof(label));
+            p += sizeof(label);
+            if (rte_be_to_cpu_32(label) & MPLS_BOTTOM_OF_STACK)
+                break;
+        }
+        if (i == L2_MAX_MPLS_LABELS)
+            return UNKNOWN_PACKET;
+        switch (*p >> 4) {
+            case 4:
+                type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+                break;
+            case 6:
+                type = rte_cpu_to_be_16(ETHER_TYPE_IPv6);
+                break;
+            default:
+                return UNKNOWN_PACKET;
+        }
+    }
+
+    *l3 = p;
+    return rte_be_to_cpu_16(type);
+}
+
+static __inline__ pktType_e
+packet_type( struct rte_mbuf * m, uint8_t **l3, uint16_t *vlan )
+{
+    struct ether_hdr *eth = rte_pktmbuf_mtod(m, struct ether_hdr *);
+    uint8_t *end = rte_pktmbuf_mtod(m, uint8_t *) + rte_pktmbuf_data_len(m);
+
+    /* vlan_tci is the inner tag when the NIC stripped two */
+    *vlan = (m->ol_flags & PKT_RX_VLAN_STRIPPED) ? (m->vlan_tci & 0xfff) : 0;
+
+    /* the NIC found IP right behind the Ethernet header: no walk. Some PMDs
+     * report tagged frames as plain Ethernet, hence the ethertype check. */
+    if (RTE_ETH_IS_IPV4_HDR(m->packet_type) &&
+        eth->ether_type == rte_cpu_to_be_16(ETHER_TYPE_IPv4)) {
+        *l3 = (uint8_t *)&eth[1];
+        return ETHER_TYPE_IPv4;
+    }
+    if (RTE_ETH_IS_IPV6_HDR(m->packet_type) &&
+        eth->ether_type == rte_cpu_to_be_16(ETHER_TYPE_IPv6)) {
+        *l3 = (uint8_t *)&eth[1];
+        return ETHER_TYPE_IPv6;
+    }
+
+    return l2_walk((uint8_t *)&eth[1], end, eth->ether_type, l3, vlan);
+}
+
+/*
+ * Index the flow table with the Toeplitz hash of the flow key under the
+ * symmetric RSS key: the addresses and, for TCP and UDP, the ports, as the
+ * NIC hashes an unfragmented packet of the flow. The NIC's hash is taken
+ * when it covered that same tuple; fragments, packets it did not hash and
+ * ones it parsed otherwise are hashed here, so every packet of a flow gets
+ * the same value. Tunnelled flows keep the software hash.
+ */
+static __inline__ void
+packet_rss(struct rte_mbuf * m, uint8_t tunnel, const union rte_table_netflow_key *k,
+        struct rte_table_netflow_pkt *pkt)
+{
+    uint32_t ptype = m->packet_type, l4 = ptype & RTE_PTYPE_L4_MASK;
+    uint32_t tuple[RTE_THASH_V6_L4_LEN], len, i;
+    int ports = k->proto == IPPROTO_TCP || k->proto == IPPROTO_UDP;
+
+    pkt->has_rss = 0;
+    if (!probe.rss_hash || tunnel != NETFLOW_TUNNEL_NONE)
+        return;
+    pkt->has_rss = 1;
+
+    if ((m->ol_flags & PKT_RX_RSS_HASH) && (ptype & RTE_PTYPE_TUNNEL_MASK) == 0 &&
+        (RTE_ETH_IS_IPV4_HDR(ptype) || RTE_ETH_IS_IPV6_HDR(ptype)) &&
+        (ports ? l4 == RTE_PTYPE_L4_TCP || l4 == RTE_PTYPE_L4_UDP :
+                 l4 == RTE_PTYPE_L4_ICMP || l4 == RTE_PTYPE_L4_NONFRAG)) {
+        pkt->rss = m->hash.rss;
+        return;
+    }
+
+    if (pkt->addr6 == NULL) {
+        tuple[0] = rte_be_to_cpu_32(k->ip_src);
+        tuple[1] = rte_be_to_cpu_32(k->ip_dst);
+        len = RTE_THASH_V4_L3_LEN;
+    } else {
+        memcpy(tuple, pkt->addr6, sizeof(*pkt->addr6));
+        for (i = 0; i < RTE_THASH_V6_L3_LEN; i++)
+            tuple[i] = rte_be_to_cpu_32(tuple[i]);
+        len = RTE_THASH_V6_L3_LEN;
+    }
+    if (ports)
+        tuple[len++] = (uint32_t)rte_be_to_cpu_16(k->port_src) << 16 |
+            rte_be_to_cpu_16(k->port_dst);
+    pkt->rss = rte_softrss_be(tuple, len, (const uint8_t *)probe.rss_key_be);
+}
+
+/* Tunnel a packet came in, see packet_decap() */
+struct tunnel_info {
+    uint8_t type;                   /* NETFLOW_TUNNEL_* */
+    uint32_t id;                    /* VNI, GRE key or TEID, host order */
+    uint32_t src, dst;              /* outer IPv4 endpoints, network order */
+};
+
+#define GTPU_MAX_EXT_HDRS   4
+
+/* The NIC's tunnel packet type, if it is one --decap asked for */
+static __inline__ uint8_t
+ptype_tunnel(uint32_t ptype)
+{
+    uint8_t type;
+
+    switch (ptype & RTE_PTYPE_TUNNEL_MASK) {
+        case RTE_PTYPE_TUNNEL_VXLAN: type = NETFLOW_TUNNEL_VXLAN; break;
+        case RTE_PTYPE_TUNNEL_GRE:   type = NETFLOW_TUNNEL_GRE;   break;
+        case RTE_PTYPE_TUNNEL_GTPU:  type = NETFLOW_TUNNEL_GTPU;  break;
+        default:                     return NETFLOW_TUNNEL_NONE;
+    }
+    return (probe.decap.types & (1 << type)) ? type : NETFLOW_TUNNEL_NONE;
+}
+
+/* Tunnel carried on a UDP destination port, network order */
+static __inline__ uint8_t
+udp_tunnel(uint16_t port)
+{
+    int i;
+
+    for (i = 0; i < probe.decap.nb_udp; i++)
+        if (probe.decap.udp_port[i] == port)
+            return probe.decap.udp_type[i];
+    return NETFLOW_TUNNEL_NONE;
+}
+
+/* IP header right behind a tunnel header, by its version nibble */
+static __inline__ pktType_e
+ip_version_type(const uint8_t *p, const uint8_t *end)
+{
+    if (p >= end)
+        return UNKNOWN_PACKET;
+    switch (*p >> 4) {
+        case 4:  return ETHER_TYPE_IPv4;
+        case 6:  return ETHER_TYPE_IPv6;
+        default: return UNKNOWN_PACKET;
+    }
+}
+
+/****************************************************************************
+ * packet_decap - Look through the tunnel of an outer IPv4 packet
+ *
+ * VXLAN and GTP-U are recognised on the UDP ports given to --decap, GRE by
+ * its protocol number; when the NIC marks the tunnel in the packet type
+ * the port lookup is skipped. *inner is set to the inner L3 header and
+ * *tun to the tunnel. Unfragmented outer packets only.
+ *
+ * RETURNS: the inner ethertype, UNKNOWN_PACKET when this is not a tunnel
+ * to decapsulate or the headers are malformed; the packet is then
+ * accounted as the outer flow.
+ */
 static __inline__ pktType_e
-packet_type( struct rte_mbuf * m )
+packet_decap(struct rte_mbuf * m, uint8_t *l3, uint8_t **inner, struct tunnel_info *tun)
 {
-    pktType_e   ret;
+    struct ipv4_hdr *ip = (struct ipv4_hdr *)l3;
+    const uint8_t *end = rte_pktmbuf_mtod(m, uint8_t *) + rte_pktmbuf_data_len(m);
+    uint8_t *p;
     struct ether_hdr *eth;
+    pktType_e type = UNKNOWN_PACKET;
+    uint16_t proto, vlan;
+    uint32_t id;
+    int hl, len, i;
+
+    if (l3 + sizeof(struct ipv4_hdr) > end)
+        return UNKNOWN_PACKET;
+    hl = (ip->version_ihl & 0x0f) * 4;
+    if (hl < (int)sizeof(struct ipv4_hdr) || l3 + hl > end)
+        return UNKNOWN_PACKET;
+    p = l3 + hl;
+
+    if (ip->fragment_offset & rte_cpu_to_be_16(IPV4_HDR_MF_FLAG | IPV4_HDR_OFFSET_MASK))
+        return UNKNOWN_PACKET;
+
+    tun->type = ptype_tunnel(m->packet_type);
+    if (ip->next_proto_id == IPPROTO_UDP) {
+        if (p + sizeof(struct udp_hdr) > end)
+            return UNKNOWN_PACKET;
+        if (tun->type == NETFLOW_TUNNEL_NONE)
+            tun->type = udp_tunnel(((struct udp_hdr *)p)->dst_port);
+        p += sizeof(struct udp_hdr);
+    } else if (ip->next_proto_id == IPPROTO_GRE) {
+        tun->type = (probe.decap.types & (1 << NETFLOW_TUNNEL_GRE)) ?
+            NETFLOW_TUNNEL_GRE : NETFLOW_TUNNEL_NONE;
+    } else {
+        return UNKNOWN_PACKET;
+    }
 
-    eth = rte_pktmbuf_mtod(m, struct ether_hdr *);
+    switch (tun->type) {
+        case NETFLOW_TUNNEL_VXLAN:
+            /* flags with the I bit, 3 reserved bytes, 24-bit VNI, reserved byte */
+            if (p + 8 + sizeof(struct ether_hdr) > end || !(p[0] & 0x08))
+                return UNKNOWN_PACKET;
+            tun->id = p[4] << 16 | p[5] << 8 | p[6];
+            eth = (struct ether_hdr *)(p + 8);
+            type = l2_walk((uint8_t *)&eth[1], end, eth->ether_type, inner, &vlan);
+            break;
+
+        case NETFLOW_TUNNEL_GTPU:
+            /* version 1 GTP, G-PDU; the optional fields come with any of E, S, PN */
+            if (p + 8 > end || (p[0] & 0xf0) != 0x30 || p[1] != 0xff)
+                return UNKNOWN_PACKET;
+            memcpy(&id, p + 4, sizeof(id));
+            tun->id = rte_be_to_cpu_32(id);
+            hl = 8;
+            if (p[0] & 0x07) {
+                if (p + 12 > end)
+                    return UNKNOWN_PACKET;
+                hl = 12;
+                /* extension headers, length in 4-byte units, next type last */
+                for (i = 0; (p[0] & 0x04) && p[hl - 1] != 0; i++) {
+                    if (i == GTPU_MAX_EXT_HDRS || p + hl + 1 > end)
+                        return UNKNOWN_PACKET;
+                    len = p[hl] * 4;
+                    if (len == 0 || p + hl + len > end)
+                        return UNKNOWN_PACKET;
+                    hl += len;
+                }
+            }
+            *inner = p + hl;
+            type = ip_version_type(*inner, end);
+            break;
+
+        case NETFLOW_TUNNEL_GRE:
+            /* version 0 only: C, K and S add a word each, in that order */
+            if (p + 4 > end || (p[1] & 0x07) != 0)
+                return UNKNOWN_PACKET;
+            memcpy(&proto, p + 2, sizeof(proto));
+            hl = 4 + ((p[0] & 0x80) ? 4 : 0);
+            tun->id = 0;
+            if (p[0] & 0x20) {
+                if (p + hl + 4 > end)
+                    return UNKNOWN_PACKET;
+                memcpy(&id, p + hl, sizeof(id));
+                tun->id = rte_be_to_cpu_32(id);
+                hl += 4;
+            }
+            hl += (p[0] & 0x10) ? 4 : 0;
+            if (proto == rte_cpu_to_be_16(ETHER_TYPE_TEB)) {
+                eth = (struct ether_hdr *)(p + hl);
+                if ((uint8_t *)&eth[1] > end)
+                    return UNKNOWN_PACKET;
+                type = l2_walk((uint8_t *)&eth[1], end, eth->ether_type, inner, &vlan);
+            } else if (proto == rte_cpu_to_be_16(ETHER_TYPE_IPv4) ||
+                       proto == rte_cpu_to_be_16(ETHER_TYPE_IPv6)) {
+                *inner = p + hl;
+                type = ip_version_type(*inner, end);
+            }
+            break;
+
+        default:
+            return UNKNOWN_PACKET;
+    }
 
-    ret = ntohs(eth->ether_type);
+    tun->src = ip->src_addr;
+    tun->dst = ip->dst_addr;
+    return type;
+}
 
-    return ret;
+/* Key a decapsulated packet on its tunnel too, see rte_table_netflow_key */
+static __inline__ void
+key_set_tunnel(union rte_table_netflow_key *k, struct rte_table_netflow_pkt *pkt,
+        const struct tunnel_info *tun)
+{
+    k->tunnel = tun->type;
+    k->vlanId = tun->id ^ (tun->id >> 16);
+    pkt->tun_id = tun->id;
+    pkt->tun_src = tun->src;
+    pkt->tun_dst = tun->dst;
 }
 
 #define PRINT_IP(x) printf("%d.%d.%d.%d", (x&0x000000ff), (x&0x0000ff00)>>8, (x&0x00ff0000)>>16, (x&0xff000000)>>24)
@@ -87,59 +394,187 @@ print_flow(union rte_table_netflow_key *k)
 }
 
 /****************************************************************************
- * 
+ * parse_ipv4 - Build the flow key of an IPv4 packet, and what it adds to
+ * the flow in *pkt
+ *
+ * l3 may be the inner header of a tunnel, so the header is checked against
+ * the segment. The ports follow the header's options; non first fragments,
+ * and upper layer headers past the segment, are accounted without ports.
+ * Returns -1 when the IPv4 header itself is cut short.
  */
-void
-process_ipv4(struct rte_mbuf * m, int vlan)
+static __inline__ int
+parse_ipv4(struct rte_mbuf * m, uint8_t *l3, uint16_t vlan, union rte_table_netflow_key *k,
+        struct rte_table_netflow_pkt *pkt)
 {
-    struct rte_table_netflow *t = table_ref;
-    struct ether_hdr *eth = rte_pktmbuf_mtod(m, struct ether_hdr *);
-    struct ipv4_hdr  *ip  = (struct ipv4_hdr *)&eth[1];
-    struct tcp_hdr   *tcp;
-    struct udp_hdr   *udp;
-       
-    union rte_table_netflow_key k;
+    struct ipv4_hdr  *ip  = (struct ipv4_hdr *)l3;
+    const uint8_t    *end = rte_pktmbuf_mtod(m, uint8_t *) + rte_pktmbuf_data_len(m);
+    const uint8_t    *l4;
+    uint8_t ihl;
+
+    if (l3 + sizeof(struct ipv4_hdr) > end)
+        return -1;
+    ihl = (ip->version_ihl & 0x0f) * 4;
+    if (ihl < sizeof(struct ipv4_hdr) || l3 + ihl > end)
+        return -1;
+
     /* To silence warnings */
-    k.port_src = 0; 
-    k.port_dst = 0; 
+    k->port_src = 0; 
+    k->port_dst = 0; 
 
-    /* Adjust for a vlan header if present */
-    if (vlan)
-        ip = (struct ipv4_hdr *)((char *)ip + sizeof(struct vlan_hdr));
+    k->ip_src = ip->src_addr;
+    k->ip_dst = ip->dst_addr;
+    k->proto  = ip->next_proto_id;
+    k->tunnel = NETFLOW_TUNNEL_NONE;
+    k->vlanId = vlan;
 
-    k.ip_src = ip->src_addr;
-    k.ip_dst = ip->dst_addr;
-    k.proto  = ip->next_proto_id;
-    k.pad0 = 0;
-    k.pad1 = 0;
-    k.vlanId = vlan;
+    pkt->l3_len = rte_be_to_cpu_16(ip->total_length);
+    pkt->tos = ip->type_of_service;
+    pkt->tcp_flags = 0;
+    pkt->addr6 = NULL;
+
+    /* only the first fragment carries the upper layer header */
+    l4 = l3 + ihl;
+    if ((ip->fragment_offset & rte_cpu_to_be_16(IPV4_HDR_OFFSET_MASK)) ||
+        l4 + sizeof(struct udp_hdr) > end)
+        return 0;
 
     //print_ipv4(ip);
     // based on proto, TCP/UDP/ICMP...
     switch(ip->next_proto_id) {
         case IPPROTO_UDP:
-            udp = (struct udp_hdr *)((unsigned char*)ip + sizeof(struct ipv4_hdr)); 
-            k.port_src = udp->src_port;
-            k.port_dst = udp->dst_port;
+            k->port_src = ((const struct udp_hdr *)l4)->src_port;
+            k->port_dst = ((const struct udp_hdr *)l4)->dst_port;
             break;
         
         case IPPROTO_TCP:
-            tcp = (struct tcp_hdr *)((unsigned char*)ip + sizeof(struct ipv4_hdr));
-            k.port_src = tcp->src_port;
-            k.port_dst = tcp->dst_port;
+            k->port_src = ((const struct tcp_hdr *)l4)->src_port;
+            k->port_dst = ((const struct tcp_hdr *)l4)->dst_port;
+            if (l4 + offsetof(struct tcp_hdr, rx_win) <= end)
+                pkt->tcp_flags = ((const struct tcp_hdr *)l4)->tcp_flags;
             break;
         
         default:
             break;
     }
-    rte_table_netflow_entry_add(t, &k, ip);
+    return 0;
+}
+
+/* Fold an IPv6 address into the 32 bits of an IPv4 key field */
+static __inline__ uint32_t
+fold_ipv6(const uint8_t *addr)
+{
+    uint64_t w[2];
+
+    memcpy(w, addr, sizeof(w));
+    return rte_hash_crc_8byte(w[1], rte_hash_crc_8byte(w[0], 0));
+}
+
+#define IPV6_MAX_EXT_HDRS   8       /* extension headers followed before giving up on L4 */
+
+/****************************************************************************
+ * parse_ipv6 - Build the flow key of an IPv6 packet, and what it adds to
+ * the flow in *pkt
+ *
+ * Follows the extension headers to the upper layer protocol, which goes in
+ * the key with its ports. Non first fragments, and chains that are too
+ * long or run past the segment, are accounted without ports. Returns -1
+ * when the IPv6 header itself is cut short.
+ */
+static __inline__ int
+parse_ipv6(struct rte_mbuf * m, uint8_t *l3, uint16_t vlan, union rte_table_netflow_key *k,
+        struct rte_table_netflow_pkt *pkt)
+{
+    struct ipv6_hdr  *ip6 = (struct ipv6_hdr *)l3;
+    const uint8_t    *end = rte_pktmbuf_mtod(m, uint8_t *) + rte_pktmbuf_data_len(m);
+    const uint8_t    *l4;
+    uint8_t proto;
+    int i;
+
+    if (l3 + sizeof(struct ipv6_hdr) > end)
+        return -1;
+
+    k->ip_src = fold_ipv6(ip6->src_addr);
+    k->ip_dst = fold_ipv6(ip6->dst_addr);
+    k->port_src = 0;
+    k->port_dst = 0;
+    k->tunnel = NETFLOW_TUNNEL_NONE;
+    k->vlanId = vlan;
+
+    pkt->l3_len = sizeof(struct ipv6_hdr) + rte_be_to_cpu_16(ip6->payload_len);
+    pkt->tos = rte_be_to_cpu_32(ip6->vtc_flow) >> 20;   /* traffic class */
+    pkt->tcp_flags = 0;
+    pkt->addr6 = (const struct rte_table_netflow_addr6 *)ip6->src_addr;
+
+    proto = ip6->proto;
+    l4 = (const uint8_t *)&ip6[1];
+    for (i = 0; l4 != NULL; i++) {
+        if (proto != IPPROTO_HOPOPTS && proto != IPPROTO_ROUTING &&
+            proto != IPPROTO_DSTOPTS && proto != IPPROTO_AH &&
+            proto != IPPROTO_FRAGMENT)
+            break;
+        if (i == IPV6_MAX_EXT_HDRS || l4 + 8 > end) {
+            l4 = NULL;
+            break;
+        }
+        switch (proto) {
+            case IPPROTO_FRAGMENT:
+                proto = l4[0];
+                /* only the first fragment carries the upper layer header */
+                l4 = ((l4[2] << 8 | l4[3]) & 0xfff8) ? NULL : l4 + 8;
+                break;
+            case IPPROTO_AH:
+                proto = l4[0];
+                l4 += (l4[1] + 2) * 4;
+                break;
+            default:
+                proto = l4[0];
+                l4 += (l4[1] + 1) * 8;
+                break;
+        }
+    }
+    k->proto = proto;
+
+    if (l4 == NULL || l4 + sizeof(struct udp_hdr) > end)
+        return 0;
+    switch (proto) {
+        case IPPROTO_UDP:
+            k->port_src = ((const struct udp_hdr *)l4)->src_port;
+            k->port_dst = ((const struct udp_hdr *)l4)->dst_port;
+            break;
+
+        case IPPROTO_TCP:
+            k->port_src = ((const struct tcp_hdr *)l4)->src_port;
+            k->port_dst = ((const struct tcp_hdr *)l4)->dst_port;
+            if (l4 + offsetof(struct tcp_hdr, rx_win) <= end)
+                pkt->tcp_flags = ((const struct tcp_hdr *)l4)->tcp_flags;
+            break;
+
+        default:
+            break;
+    }
+    return 0;
+}
+
+/****************************************************************************
+ * process_ipv4 - Account a single packet, if it is IPv4, in the IPv4 shard
+ * of this lcore
+ */
+void
+process_ipv4(struct rte_mbuf * m)
+{
+    struct rte_table_netflow *t = RTE_PER_LCORE(table_ref);
+    union rte_table_netflow_key k;
+    struct rte_table_netflow_pkt pkt;
+    uint8_t *l3;
+    uint16_t vlan;
+
+    if (packet_type(m, &l3, &vlan) != ETHER_TYPE_IPv4 ||
+        parse_ipv4(m, l3, vlan, &k, &pkt) < 0)
+        return;
+    packet_rss(m, NETFLOW_TUNNEL_NONE, &k, &pkt);
+    rte_table_netflow_entry_add(t, &k, &pkt);
 
     //print_flow(&k);
-    //TODO
-    // 1) decode flow header
-    // 2) pkt to hash
-    //printf("%" PRIu32 "\n", init_val);
-    // 3) process hash table (export flows)
 }
 
 
@@ -157,59 +592,176 @@ process_ipv4(struct rte_mbuf * m, int vlan)
 */
 #define FCS_SIZE 4
 
+/* Index of the per family arrays of packet_classify_bulk() */
+#define FAMILY_IPV4     0
+#define FAMILY_IPV6     1
+
+/* Flow sampling keeps the flows whose key hashes into 1/N of the range;
+ * the others count as unsampled in t, the shard of their family */
+static __inline__ int
+key_sampled(const sampling_t *s, const union rte_table_netflow_key *k,
+        struct rte_table_netflow *t)
+{
+    if (likely(s->mode != SAMPLE_HASH))
+        return 1;
+    if (rte_table_netflow_hash_mulshift(k, SAMPLE_HASH_SEED) <= s->threshold)
+        return 1;
+    t->n_unsampled++;
+    return 0;
+}
+
 static void
-packet_classify( struct rte_mbuf * m)
+packet_classify( struct rte_mbuf * m, const sampling_t *s, union rte_table_netflow_key keys[][MAX_PKT_BURST],
+        struct rte_table_netflow_pkt pkts[][MAX_PKT_BURST], uint32_t *n)
 {
-    pktType_e   pType;
+    pktType_e   pType, iType;
+    uint8_t     *l3, *inner;
+    uint16_t    vlan;
+    struct tunnel_info tun;
 
-    pType = packet_type(m);
+    pType = packet_type(m, &l3, &vlan);
+
+    /* account a tunnelled packet as its inner flow; the outer one otherwise */
+    tun.type = NETFLOW_TUNNEL_NONE;
+    if (pType == ETHER_TYPE_IPv4 && probe.decap.types) {
+        iType = packet_decap(m, l3, &inner, &tun);
+        if (iType == ETHER_TYPE_IPv4 || iType == ETHER_TYPE_IPv6) {
+            pType = iType;
+            l3 = inner;
+        } else
+            tun.type = NETFLOW_TUNNEL_NONE;
+    }
 
     switch((int)pType) {
         case ETHER_TYPE_ARP:    //printf("arp\n"); 
            break;
         case ETHER_TYPE_IPv4:   //printf("ipv4\n");
-           process_ipv4(m, 0);  break;
-        case ETHER_TYPE_IPv6:   //printf("ipv6\n");
+           if (parse_ipv4(m, l3, vlan, &keys[FAMILY_IPV4][n[FAMILY_IPV4]], &pkts[FAMILY_IPV4][n[FAMILY_IPV4]]) < 0)
+               break;
+           packet_rss(m, tun.type, &keys[FAMILY_IPV4][n[FAMILY_IPV4]], &pkts[FAMILY_IPV4][n[FAMILY_IPV4]]);
+           if (tun.type != NETFLOW_TUNNEL_NONE)
+               key_set_tunnel(&keys[FAMILY_IPV4][n[FAMILY_IPV4]], &pkts[FAMILY_IPV4][n[FAMILY_IPV4]], &tun);
+           if (key_sampled(s, &keys[FAMILY_IPV4][n[FAMILY_IPV4]], RTE_PER_LCORE(table_ref)))
+               n[FAMILY_IPV4]++;
            break;
-        case ETHER_TYPE_VLAN:   //printf("vlan\n");
+        case ETHER_TYPE_IPv6:   //printf("ipv6\n");
+           if (parse_ipv6(m, l3, vlan, &keys[FAMILY_IPV6][n[FAMILY_IPV6]], &pkts[FAMILY_IPV6][n[FAMILY_IPV6]]) < 0)
+               break;
+           packet_rss(m, tun.type, &keys[FAMILY_IPV6][n[FAMILY_IPV6]], &pkts[FAMILY_IPV6][n[FAMILY_IPV6]]);
+           if (tun.type != NETFLOW_TUNNEL_NONE)
+               key_set_tunnel(&keys[FAMILY_IPV6][n[FAMILY_IPV6]], &pkts[FAMILY_IPV6][n[FAMILY_IPV6]], &tun);
+           if (key_sampled(s, &keys[FAMILY_IPV6][n[FAMILY_IPV6]], RTE_PER_LCORE(table6_ref)))
+               n[FAMILY_IPV6]++;
            break;
         case UNKNOWN_PACKET:    //printf("unknown\n");/* FALL THRU */
         default:                
            break;
     }
-    
 }
 
+/* A packet the NIC marked for one of the lcore's heavy flows, accounted already */
+static __inline__ int
+packet_marked(struct rte_mbuf * m, struct rte_table_netflow *t)
+{
+    uint8_t *l3;
+    uint16_t vlan;
+
+    if (!(m->ol_flags & PKT_RX_FDIR_ID) ||
+        packet_type(m, &l3, &vlan) != ETHER_TYPE_IPv4)
+        return 0;
+    return rte_table_netflow_mark_account(t, m->hash.fdir.hi, l3,
+            rte_pktmbuf_mtod(m, uint8_t *) + rte_pktmbuf_data_len(m) - l3);
+}
+
+/*
+ * Packet sampling of the burst, all from one port: put the packets the
+ * deterministic or the random mode keep in sel[]. Returns their number.
+ */
+static __inline__ int
+packet_sample(struct rte_mbuf **pkts, int nb_rx, struct rte_mbuf **sel,
+        const sampling_t *s, struct rte_table_netflow *t)
+{
+    uint16_t *skip = &RTE_PER_LCORE(sample_skip)[pkts[0]->port];
+    uint64_t x = RTE_PER_LCORE(sample_rand);
+    int j, n = 0;
+
+    if (s->mode == SAMPLE_DETERMINISTIC) {
+        for (j = *skip; j < nb_rx; j += s->rate)
+            sel[n++] = pkts[j];
+        *skip = j - nb_rx;
+    } else {
+        if (unlikely(x == 0))
+            x = rte_rdtsc() | 1;
+        for (j = 0; j < nb_rx; j++) {
+            x ^= x >> 12;
+            x ^= x << 25;
+            x ^= x >> 27;
+            if ((uint32_t)((x * 0x2545f4914f6cdd1dULL) >> 32) <= s->threshold)
+                sel[n++] = pkts[j];
+        }
+        RTE_PER_LCORE(sample_rand) = x;
+    }
+    t->n_unsampled += nb_rx - n;
+    return n;
+}
 
 /*************************************************************
  * packet classify - Classify a set of packets in one call
  * 
  * DESCRIPTION
- * Classify a list of packets and to improve clasify peformance.
+ * Classify a list of packets in stages: leave out the packets that the
+ * sampling of the port skips, parse the flow key of every other packet
+ * (prefetching packet data ahead), except for those the NIC marked
+ * as part of a known flow, then hand the IPv4 and the IPv6
+ * packets of the burst to their tables, which hash them and prefetch the
+ * table memory they need before updating any flow.
  * 
  * Return: N/A
  */
 #define PREFETCH_OFFSET     3
 static __inline__ void
-packet_classify_bulk(struct rte_mbuf **pkts, int nb_rx, struct rte_table_netflow *t)
+packet_classify_bulk(struct rte_mbuf **pkts, int nb_rx, uint16_t queue,
+        struct rte_table_netflow *t, struct rte_table_netflow *t6)
 {
+    union rte_table_netflow_key keys[2][MAX_PKT_BURST];
+    struct rte_table_netflow_pkt meta[2][MAX_PKT_BURST];
+    struct rte_mbuf *sel[MAX_PKT_BURST];
+    const sampling_t *s = &probe.sampling[pkts[0]->port];
+    uint32_t n[2] = { 0, 0 };
     int j;
-	table_ref = t;
+    RTE_PER_LCORE(table_ref) = t;
+    RTE_PER_LCORE(table6_ref) = t6;
+    rte_table_netflow_burst(t);
+    rte_table_netflow_burst(t6);
+    t->rx_port = t6->rx_port = pkts[0]->port;
+    t->rx_queue = t6->rx_queue = queue;
+
+    /* packet sampling leaves most packets before they are even read */
+    if (s->mode == SAMPLE_DETERMINISTIC || s->mode == SAMPLE_RANDOM) {
+        nb_rx = packet_sample(pkts, nb_rx, sel, s, t);
+        pkts = sel;
+    }
+
     /* Prefetch first packets */
     for (j = 0; j < PREFETCH_OFFSET && j < nb_rx; j++)
         rte_prefetch0(rte_pktmbuf_mtod(pkts[j], void *));
 
-    /* Prefetch and handle already prefetched packets */
+    /* Prefetch and parse already prefetched packets */
     for (j = 0; j < (nb_rx-PREFETCH_OFFSET); j++) {
         rte_prefetch0(rte_pktmbuf_mtod(pkts[j + PREFETCH_OFFSET], void *));
-        packet_classify(pkts[j]);
+        if (!packet_marked(pkts[j], t))
+            packet_classify(pkts[j], s, keys, meta, n);
     }
 
+    /* Parse remaining prefetched packets */
+    for (; j < nb_rx; j++)
+        if (!packet_marked(pkts[j], t))
+            packet_classify(pkts[j], s, keys, meta, n);
+
     /* TODO */
     // Additional processing like DPI
-    
-    /* Handle remaining prefetched packets */
-    for (; j < nb_rx; j++)
-        packet_classify(pkts[j]);
 
+    rte_table_netflow_entry_add_bulk(t, keys[FAMILY_IPV4], meta[FAMILY_IPV4], n[FAMILY_IPV4]);
+    if (n[FAMILY_IPV6])
+        rte_table_netflow_entry_add_bulk(t6, keys[FAMILY_IPV6], meta[FAMILY_IPV6], n[FAMILY_IPV6]);
 }
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 
 #include <rte_byteorder.h>
 #include <rte_lcore.h>
@@ -12,12 +13,14 @@
 #include <rte_udp.h>
 #include <rte_tcp.h>
 #include <rte_hash_crc.h>
+#include <rte_thash.h>
 
 #include "rte_table_netflow.h"
 
 #define NETFLOW_APP_NAME        "Netflow DPDK"
+#define RSS_SOFT_KEY_LEN        40      /* RSS key bytes an IPv6 TCP/UDP tuple reaches */
 
-#define MAX_PKT_BURST   16
+#define MAX_PKT_BURST   32
 
 typedef struct rte_eth_stats    eth_stats_t;
 
@@ -45,12 +48,15 @@ typedef struct port_info_s {
     eth_stats_t             rate_stats;             /**< current packet rate statistics */
 
     struct rte_eth_link     link;                   /**< Link information link speed and duplex */
+    uint64_t                tx_offloads;            /**< DEV_TX_OFFLOAD_* enabled on the port */
+    int                     socket_id;              /**< NUMA socket of the NIC, < _NB_SOCKETS */
 } port_info_t;
 
 //##### Temp #####
 #define _RTE_MAX_ETHPORTS 2
 #define _NB_SOCKETS 2
 #define _MAX_LCORE 8
+#define _MAX_RXQ_PER_LCORE 16
 
 /* Netflow Collector information */
 typedef struct collector_s {
@@ -58,13 +64,44 @@ typedef struct collector_s {
     int port;
     int sockfd;
     struct sockaddr_in servaddr;
+    int tx_port;                    /**< DPDK port to export through, -1 = kernel socket */
+    uint16_t tx_queue;              /**< its tx queue reserved for the export lcore */
+    struct ether_addr dst_mac;      /**< collector, or next hop, MAC */
+    uint32_t src_ip;                /**< export source address, network order */
 } collector_t;
 
-/* lcore, port, queue mapping table */
+/* Tunnels accounted as their inner flow, see --decap */
+#define DECAP_MAX_UDP_PORTS 4
+
+typedef struct decap_s {
+    uint8_t types;                  /**< 1 << NETFLOW_TUNNEL_* enabled, 0 = no decap */
+    uint8_t nb_udp;
+    uint8_t udp_type[DECAP_MAX_UDP_PORTS];          /**< NETFLOW_TUNNEL_VXLAN or _GTPU */
+    uint16_t udp_port[DECAP_MAX_UDP_PORTS];         /**< UDP destination port, network order */
+} decap_t;
+
+/* Packet sampling of a port, see --sample */
+#define SAMPLE_NONE             0
+#define SAMPLE_DETERMINISTIC    1           /* every N-th packet */
+#define SAMPLE_RANDOM           2           /* each packet with probability 1/N */
+#define SAMPLE_HASH             3           /* every packet of 1/N of the flows */
+#define SAMPLE_MAX_RATE         16383       /* the v5 header has 14 bits for N */
+#define SAMPLE_HASH_SEED        0x9e3779b97f4a7c15ULL   /* independent of the table hash */
+
+typedef struct sampling_s {
+    uint8_t mode;                   /**< SAMPLE_*, SAMPLE_NONE = every packet */
+    uint16_t rate;                  /**< N */
+    uint32_t threshold;             /**< random draws or key hashes <= this are sampled */
+} sampling_t;
+
+/* lcore, port, queue mapping table, one entry per datapath lcore */
 typedef struct l2p_s {
     uint8_t lcore_id;
-    uint8_t port_id;
-    uint8_t queue_id;
+    uint8_t nb_rxq;                                 /**< Number of (port, queue) pairs polled */
+    struct {
+        uint8_t port_id;
+        uint8_t queue_id;
+    } rxq[_MAX_RXQ_PER_LCORE];
 } l2p_t;
 
 typedef struct probe_s {
@@ -80,15 +117,31 @@ typedef struct probe_s {
     // Netflow collector
     collector_t collector;
 
+    decap_t decap;
+
+    sampling_t sampling[_RTE_MAX_ETHPORTS];
+
+    /* every port hashes IP flows with the symmetric RSS key, see init_port() */
+    uint8_t rss_hash;
+    uint32_t rss_key_be[RSS_SOFT_KEY_LEN / 4];  /* that key for rte_softrss_be() */
+
     // port to lcore mapping
+    uint8_t                 nb_workers;             /* Number of valid l2p entries */
     l2p_t                   l2p[_MAX_LCORE];
+    uint8_t                 export_lcore;           /* lcore draining the export rings */
 
     /* Statistics */
     port_info_t             info[_RTE_MAX_ETHPORTS];     /**< Port Information                 */
 
-    /* hash table */
-    //struct rte_table_netflow my_table[2];
-    struct rte_table_netflow *table[_RTE_MAX_ETHPORTS];
+    /*
+     * hash table, two shards per worker: IPv4 flows in table[w], IPv6 flows
+     * in table[nb_workers + w], both owned by l2p[w].lcore_id
+     */
+    uint8_t                 nb_tables;              /* 2 * nb_workers */
+    struct rte_table_netflow *table[2 * _MAX_LCORE];
+
+    /* live flow snapshot file, written by the export lcore, or NULL */
+    struct rte_table_netflow_snapshot *snapshot;
 
 } probe_t;
 
@@ -96,6 +149,6 @@ typedef struct probe_s {
 extern int launch_probe(__attribute__ ((unused)) void * arg);
 void print_ipv4(struct ipv4_hdr *);
 void print_flow(union rte_table_netflow_key *);
-void process_ipv4(struct rte_mbuf *, int);
+void process_ipv4(struct rte_mbuf *);
 
 #endif
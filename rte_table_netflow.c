@@ -34,6 +34,7 @@
 #include <netinet/in.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -41,15 +42,17 @@
 #include <unistd.h>
 
 #include <rte_common.h>
+#include <rte_lcore.h>
 #include <rte_mbuf.h>
 #include <rte_malloc.h>
 #include <rte_log.h>
 #include <rte_byteorder.h>
 #include <rte_hash_crc.h>
+#include <rte_ip.h>
+#include <rte_tcp.h>
 
 #include "rte_table_netflow.h"
 
-uint64_t global_packet_count;
 
 void *
 rte_table_netflow_create(void *params, int socket_id, uint32_t entry_size)
@@ -59,25 +62,33 @@ rte_table_netflow_create(void *params, int socket_id, uint32_t entry_size)
 
     struct rte_table_netflow *t;
     uint32_t total_cl_size, total_size;
-    uint32_t i;
+    uint32_t n_sets;
+    char ring_name[RTE_RING_NAMESIZE];
+    static uint32_t n_tables;
 
+    if (p == NULL)
+        return NULL;
     if (p->n_entries > MAX_ENTRY) {
         RTE_LOG(ERR, TABLE, "Entry is large than MAX_ENTRY(%d)\n", (uint32_t)MAX_ENTRY);
         p->n_entries = MAX_ENTRY;
     }
 
     /* Check input parameters */
-    if ((p == NULL) ||
-        (p->n_entries == 0) ||
+    if ((p->f_hash == NULL) ||
+        (p->n_entries < 2 * NETFLOW_SET_LOAD) ||
         (!rte_is_power_of_2(p->n_entries)) ) {
         return NULL;
     }
+    n_sets = p->n_entries / NETFLOW_SET_LOAD;
+
+    /* everything a packet updates must stay within one line */
+    RTE_BUILD_BUG_ON(sizeof(hashBucket_t) != RTE_CACHE_LINE_SIZE);
+    RTE_BUILD_BUG_ON(sizeof(hashBucket_cold_t) != RTE_CACHE_LINE_SIZE);
 
     /* Memory allocation */
     total_cl_size = (sizeof(struct rte_table_netflow) +
             RTE_CACHE_LINE_SIZE) / RTE_CACHE_LINE_SIZE;
-    total_cl_size += (p->n_entries * sizeof(hashBucket_t*) + 
-            RTE_CACHE_LINE_SIZE) / RTE_CACHE_LINE_SIZE;
+    total_cl_size += n_sets;
     total_size = total_cl_size * RTE_CACHE_LINE_SIZE;
     t = rte_zmalloc_socket("TABLE", total_size, RTE_CACHE_LINE_SIZE, socket_id);
     if (t == NULL) {
@@ -87,39 +98,750 @@ rte_table_netflow_create(void *params, int socket_id, uint32_t entry_size)
         return NULL;
     }
 
-    /* Spinlock initialization */
-    for (i = 0; i < p->n_entries; i++) {
-        rte_spinlock_init(&t->lock[i]);
+    /* Bucket pool, all buckets start on the free stack */
+    t->pool = rte_zmalloc_socket("BUCKET", (size_t)p->n_entries * sizeof(hashBucket_t),
+            RTE_CACHE_LINE_SIZE, socket_id);
+    t->cold = rte_zmalloc_socket("BUCKET_COLD", (size_t)p->n_entries * sizeof(hashBucket_cold_t),
+            RTE_CACHE_LINE_SIZE, socket_id);
+    t->exp = rte_zmalloc_socket("BUCKET_EXP", (size_t)p->n_entries * sizeof(hashBucket_exp_t),
+            RTE_CACHE_LINE_SIZE, socket_id);
+    t->free_bkts = rte_malloc_socket("BUCKET_FREE", (size_t)p->n_entries * sizeof(hashBucket_t *),
+            RTE_CACHE_LINE_SIZE, socket_id);
+    t->dirty[0] = rte_malloc_socket("BUCKET_DIRTY", (size_t)p->n_entries * sizeof(uint32_t),
+            RTE_CACHE_LINE_SIZE, socket_id);
+    t->dirty[1] = rte_malloc_socket("BUCKET_DIRTY", (size_t)p->n_entries * sizeof(uint32_t),
+            RTE_CACHE_LINE_SIZE, socket_id);
+    if (p->ipv6)
+        t->addr6 = rte_malloc_socket("BUCKET_ADDR6",
+                (size_t)p->n_entries * sizeof(struct rte_table_netflow_addr6),
+                RTE_CACHE_LINE_SIZE, socket_id);
+    if (t->pool == NULL || t->cold == NULL || t->exp == NULL || t->free_bkts == NULL ||
+        t->dirty[0] == NULL || t->dirty[1] == NULL ||
+        (p->ipv6 && t->addr6 == NULL)) {
+        RTE_LOG(ERR, TABLE,
+            "%s: Cannot allocate %u buckets for netflow table\n",
+            __func__, p->n_entries);
+        goto fail;
+    }
+    for (t->n_free = 0; t->n_free < p->n_entries; t->n_free++)
+        t->free_bkts[t->n_free] = &t->pool[p->n_entries - 1 - t->n_free];
+
+    /* Handoff of expired buckets to the exporter, and back once exported */
+    snprintf(ring_name, sizeof(ring_name), "NETFLOW_EXPORT_%u", n_tables);
+    t->export_ring = rte_ring_create(ring_name, EXPORT_RING_SIZE, socket_id,
+            RING_F_SP_ENQ | RING_F_SC_DEQ);
+    if (t->export_ring == NULL) {
+        RTE_LOG(ERR, TABLE, "%s: Cannot create %s\n", __func__, ring_name);
+        goto fail;
+    }
+    snprintf(ring_name, sizeof(ring_name), "NETFLOW_RETURN_%u", n_tables++);
+    t->return_ring = rte_ring_create(ring_name, rte_align32pow2(p->n_entries + 1),
+            socket_id, RING_F_SP_ENQ | RING_F_SC_DEQ);
+    if (t->return_ring == NULL) {
+        RTE_LOG(ERR, TABLE, "%s: Cannot create %s\n", __func__, ring_name);
+        goto fail;
     }
 
     /* Memory initialzation */
     t->entry_size = entry_size;
     t->n_entries = p->n_entries;
+    t->n_sets = n_sets;
+    t->set_mask = n_sets - 1;
+    t->idle_ticks = IDLE_TIMEOUT * rte_get_tsc_hz();
+    t->lifetime_ticks = LIFETIME_TIMEOUT * rte_get_tsc_hz();
+    t->now = rte_rdtsc();
+    t->tw_tick = rte_get_tsc_hz() >> NETFLOW_TW_HZ_SHIFT;
+    t->tw_now = t->now / t->tw_tick;
+    t->tw_cascade = NETFLOW_TW_NIL;
+    t->evict_reserve = p->n_entries >> EVICT_RESERVE_SHIFT;
+    t->evict_min_idle = EVICT_MIN_IDLE_MS * rte_get_tsc_hz() / 1000;
+    memset(t->tw_l0, 0xff, sizeof(t->tw_l0));
+    memset(t->tw_l1, 0xff, sizeof(t->tw_l1));
+    t->epoch = t->epoch_req = t->export_epoch = 1;
     t->f_hash = p->f_hash;
+    t->f_hash_bulk = p->f_hash_bulk;
     t->seed = p->seed;
 
-    global_packet_count = 0;
-
     return t;
+
+fail:
+    rte_ring_free(t->export_ring);
+    rte_free(t->dirty[0]);
+    rte_free(t->dirty[1]);
+    rte_free(t->free_bkts);
+    rte_free(t->addr6);
+    rte_free(t->exp);
+    rte_free(t->cold);
+    rte_free(t->pool);
+    rte_free(t);
+    return NULL;
 }
 
-int
-rte_table_netflow_entry_add(
-    void *table,
-    void *key,
-    void *entry)
+/* Alternative set of a key; symmetric, so it also maps back to the primary */
+static inline uint32_t
+netflow_alt_set(const struct rte_table_netflow *t, uint32_t set_idx, uint16_t sig)
+{
+    return (set_idx ^ ((sig * 0x5bd1e995U) | 1)) & t->set_mask;
+}
+
+/* Ways of a set whose signature equals sig (two movemask bits per way) */
+static inline uint32_t
+netflow_set_match(const struct rte_table_netflow_set *s, __m128i sig)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi16(s->xmm, sig)) & NETFLOW_SET_SIG_BITS;
+}
+
+static inline int
+netflow_key_equal(const hashBucket_t *bkt, const union rte_table_netflow_key *k)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(bkt->xmm, k->xmm)) == 0xffff;
+}
+
+/* Both addresses of an IPv6 flow, two 16-byte compares */
+static inline int
+netflow_addr6_equal(const struct rte_table_netflow_addr6 *a,
+        const struct rte_table_netflow_addr6 *b)
+{
+    __m128i src = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a->src),
+            _mm_loadu_si128((const __m128i *)b->src));
+    __m128i dst = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a->dst),
+            _mm_loadu_si128((const __m128i *)b->dst));
+
+    return _mm_movemask_epi8(_mm_and_si128(src, dst)) == 0xffff;
+}
+
+static inline hashBucket_t *
+netflow_set_lookup(struct rte_table_netflow *t, const struct rte_table_netflow_set *s,
+        __m128i sig, const union rte_table_netflow_key *k,
+        const struct rte_table_netflow_pkt *pkt)
+{
+    uint32_t m = netflow_set_match(s, sig);
+    uint32_t way;
+
+    while (m) {
+        way = __builtin_ctz(m) >> 1;
+        /* IPv6 and tunnels: the key only holds folded values, confirm them */
+        if (netflow_key_equal(s->bkt[way], k) &&
+            (pkt->addr6 == NULL ||
+             netflow_addr6_equal(rte_table_netflow_addr6(t, s->bkt[way]), pkt->addr6)) &&
+            (k->tunnel == NETFLOW_TUNNEL_NONE ||
+             rte_table_netflow_cold(t, s->bkt[way])->tun_id == pkt->tun_id))
+            return s->bkt[way];
+        m &= ~(3U << (way << 1));
+    }
+    return NULL;
+}
+
+/* Publish a fully initialised bucket in an empty way */
+static inline void
+netflow_set_fill(struct rte_table_netflow_set *s, uint32_t way, uint16_t sig,
+        hashBucket_t *bkt, int displaced)
+{
+    rte_smp_wmb();
+    s->bkt[way] = bkt;
+    s->sig[way] = sig;
+    if (displaced)
+        s->alt_mask |= 1 << way;
+}
+
+static inline void
+netflow_set_clear(struct rte_table_netflow *t, uint32_t set_idx, uint32_t way)
+{
+    struct rte_table_netflow_set *s = &t->sets[set_idx];
+
+    if (s->alt_mask & (1 << way)) {
+        s->alt_mask &= ~(1 << way);
+        t->sets[netflow_alt_set(t, set_idx, s->sig[way])].n_displaced--;
+    }
+    s->sig[way] = 0;
+    s->bkt[way] = NULL;
+}
+
+/*
+ * Take a zeroed bucket from the pool, only dirty_listed survives. When the
+ * free stack runs dry it is refilled in bulk with the buckets the exporter
+ * has returned.
+ */
+static inline hashBucket_t *
+netflow_bucket_get(struct rte_table_netflow *t)
+{
+    hashBucket_t *bkt;
+    uint32_t listed;
+
+    if (unlikely(t->n_free == 0)) {
+        t->n_free = rte_ring_sc_dequeue_burst(t->return_ring, (void **)t->free_bkts,
+                t->n_entries, NULL);
+        if (t->n_free == 0) {
+            t->n_alloc_fail++;
+            return NULL;
+        }
+    }
+
+    bkt = t->free_bkts[--t->n_free];
+    listed = bkt->dirty_listed;
+    memset(bkt, 0, sizeof(*bkt));
+    bkt->dirty_listed = listed;
+    memset(rte_table_netflow_cold(t, bkt), 0, sizeof(hashBucket_cold_t));
+    return bkt;
+}
+
+/*
+ * Hand exported buckets back to the shard they came from. Called by the
+ * exporter, the single producer of the return ring, which is sized so it
+ * can hold every bucket of the shard.
+ */
+void
+rte_table_netflow_bucket_put_bulk(void *table, hashBucket_t **bkts, unsigned int n)
 {
     struct rte_table_netflow *t = (struct rte_table_netflow *)table;
-    union rte_table_netflow_key *k = key;
-    struct ipv4_hdr *ip = entry;
-    struct tcp_hdr *tcp;
-    hashBucket_t *previous_pointer = NULL;
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        memset(rte_table_netflow_exp(t, bkts[i]), 0, sizeof(hashBucket_exp_t));
+    rte_ring_sp_enqueue_burst(t->return_ring, (void * const *)bkts, n, NULL);
+}
+
+/*
+ * Find an empty way for a new key: the primary set first, then the
+ * alternative set, then make room in the primary set by moving one of its
+ * own buckets to that bucket's alternative set. Returns the way, with the
+ * set in *set_idx, or -1 when all candidates are full.
+ */
+static int
+netflow_set_find_slot(struct rte_table_netflow *t, uint32_t prim, uint16_t sig,
+        uint32_t *set_idx)
+{
+    struct rte_table_netflow_set *s = &t->sets[prim];
+    struct rte_table_netflow_set *a;
+    const __m128i empty = _mm_setzero_si128();
+    uint32_t alt, way, m;
+
+    m = netflow_set_match(s, empty);
+    if (m) {
+        *set_idx = prim;
+        return __builtin_ctz(m) >> 1;
+    }
+
+    alt = netflow_alt_set(t, prim, sig);
+    m = netflow_set_match(&t->sets[alt], empty);
+    if (m) {
+        *set_idx = alt;
+        return __builtin_ctz(m) >> 1;
+    }
+
+    for (way = 0; way < NETFLOW_SET_WAYS; way++) {
+        if (s->alt_mask & (1 << way))
+            continue;
+        a = &t->sets[netflow_alt_set(t, prim, s->sig[way])];
+        m = netflow_set_match(a, empty);
+        if (m == 0)
+            continue;
+
+        /* copy before clear, so a concurrent reader never misses it */
+        netflow_set_fill(a, __builtin_ctz(m) >> 1, s->sig[way], s->bkt[way], 1);
+        s->n_displaced++;
+        t->n_displaced++;
+        netflow_set_clear(t, prim, way);
+        *set_idx = prim;
+        return way;
+    }
+
+    return -1;
+}
+
+/*
+ * Hash functions. All of them hash the 16-byte key in one pass; the table
+ * takes the set from the low bits of the result and the signature from the
+ * high 16 bits.
+ */
+
+/* CRC32 (SSE4.2) over the two 64-bit halves of the key */
+uint32_t
+rte_table_netflow_hash_crc32(const union rte_table_netflow_key *k, uint64_t seed)
+{
+    const uint64_t *w = (const uint64_t *)k;
+
+    return rte_hash_crc_8byte(w[1], rte_hash_crc_8byte(w[0], (uint32_t)seed));
+}
+
+/* Multiply-shift: two 64-bit multiplies, the high half of the sum is the hash */
+uint32_t
+rte_table_netflow_hash_mulshift(const union rte_table_netflow_key *k, uint64_t seed)
+{
+    const uint64_t *w = (const uint64_t *)k;
+
+    return ((w[0] ^ seed) * 0x9e3779b97f4a7c15ULL + w[1] * 0xc2b2ae3d27d4eb4fULL) >> 32;
+}
+
+/*
+ * Multiply-xorshift over the four 32-bit words of the key. The scalar
+ * version exists so single packets hash like bursts do; the burst version
+ * transposes four keys at a time and hashes them in the four lanes of an
+ * SSE4.1 register.
+ */
+#define NETFLOW_VEC_M1  0x9e3779b1U
+#define NETFLOW_VEC_M2  0x85ebca6bU
+
+uint32_t
+rte_table_netflow_hash_vec(const union rte_table_netflow_key *k, uint64_t seed)
+{
+    const uint32_t *w = (const uint32_t *)k;
+    uint32_t h = (uint32_t)seed;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        h = (h ^ w[i]) * NETFLOW_VEC_M1;
+        h ^= h >> 16;
+    }
+    h ^= h >> 15;
+    h *= NETFLOW_VEC_M2;
+    h ^= h >> 13;
+    return h;
+}
+
+void
+rte_table_netflow_hash_vec_bulk(const union rte_table_netflow_key *keys, uint32_t n_keys,
+        uint64_t seed, uint32_t *hash)
+{
+    const __m128i m1 = _mm_set1_epi32(NETFLOW_VEC_M1);
+    const __m128i m2 = _mm_set1_epi32(NETFLOW_VEC_M2);
+    __m128i t0, t1, t2, t3, w[4], h;
+    uint32_t i, j;
+
+    for (i = 0; i + 4 <= n_keys; i += 4) {
+        /* transpose: w[j] holds word j of the four keys */
+        t0 = _mm_unpacklo_epi32(keys[i].xmm, keys[i + 1].xmm);
+        t1 = _mm_unpacklo_epi32(keys[i + 2].xmm, keys[i + 3].xmm);
+        t2 = _mm_unpackhi_epi32(keys[i].xmm, keys[i + 1].xmm);
+        t3 = _mm_unpackhi_epi32(keys[i + 2].xmm, keys[i + 3].xmm);
+        w[0] = _mm_unpacklo_epi64(t0, t1);
+        w[1] = _mm_unpackhi_epi64(t0, t1);
+        w[2] = _mm_unpacklo_epi64(t2, t3);
+        w[3] = _mm_unpackhi_epi64(t2, t3);
+
+        h = _mm_set1_epi32((uint32_t)seed);
+        for (j = 0; j < 4; j++) {
+            h = _mm_mullo_epi32(_mm_xor_si128(h, w[j]), m1);
+            h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+        }
+        h = _mm_xor_si128(h, _mm_srli_epi32(h, 15));
+        h = _mm_mullo_epi32(h, m2);
+        h = _mm_xor_si128(h, _mm_srli_epi32(h, 13));
+        _mm_storeu_si128((__m128i *)&hash[i], h);
+    }
+
+    for (; i < n_keys; i++)
+        hash[i] = rte_table_netflow_hash_vec(&keys[i], seed);
+}
+
+static inline uint32_t
+netflow_hash(const struct rte_table_netflow *t, const union rte_table_netflow_key *k)
+{
+    return t->f_hash(k, t->seed);
+}
+
+/*
+ * Table hash of a key from its RSS hash, see packet_rss(). The queue was
+ * picked from the low bits of rss, so they are mixed back in with one CRC
+ * step; with a symmetric RSS key both directions of a connection hash
+ * alike, so the direction goes into the seed to keep them apart.
+ */
+static inline uint32_t
+netflow_hash_rss(const struct rte_table_netflow *t, const union rte_table_netflow_key *k,
+        uint32_t rss)
+{
+    return rte_hash_crc_4byte(rss, (uint32_t)t->seed ^ (k->ip_src < k->ip_dst));
+}
+
+/* Hash a burst of keys, with the RSS hash of the packets that carry a usable one */
+static inline void
+netflow_hash_bulk(const struct rte_table_netflow *t, const union rte_table_netflow_key *keys,
+        const struct rte_table_netflow_pkt *pkts, uint32_t n, uint32_t *hash)
+{
+    uint32_t i, n_sw = 0;
+
+    for (i = 0; i < n; i++) {
+        if (pkts[i].has_rss)
+            hash[i] = netflow_hash_rss(t, &keys[i], pkts[i].rss);
+        else
+            n_sw++;
+    }
+    if (n_sw == 0)
+        return;
+
+    if (t->f_hash_bulk != NULL && n_sw == n) {
+        t->f_hash_bulk(keys, n, t->seed, hash);
+        return;
+    }
+    for (i = 0; i < n; i++)
+        if (!pkts[i].has_rss)
+            hash[i] = t->f_hash(&keys[i], t->seed);
+}
+
+static inline uint16_t
+netflow_sig(uint32_t hash)
+{
+    uint16_t sig = hash >> 16;
+
+    return sig + (sig == 0);
+}
+
+/* TSC deadline of a flow: idle timeout from its last packet, capped by its lifetime */
+static inline uint64_t
+netflow_deadline(const struct rte_table_netflow *t, const hashBucket_t *bkt)
+{
+    return RTE_MIN(bkt->lastSeenSent + t->idle_ticks,
+            bkt->firstSeenSent + t->lifetime_ticks);
+}
+
+/*
+ * Thread a bucket onto the wheel slot of its deadline. Packets only move
+ * lastSeenSent forward, never the bucket: when its slot comes up the
+ * deadline is checked again and the bucket is requeued if it was pushed
+ * back, so a flow is touched about once per timeout, not per packet.
+ */
+static inline void
+netflow_tw_insert(struct rte_table_netflow *t, hashBucket_t *bkt)
+{
+    hashBucket_cold_t *c = rte_table_netflow_cold(t, bkt);
+    uint64_t tick = netflow_deadline(t, bkt) / t->tw_tick + 1;
+    uint32_t *head;
+
+    if (tick < t->tw_now)
+        tick = t->tw_now;
+
+    if (tick - t->tw_now < NETFLOW_TW_SLOTS) {
+        c->tw_slot = tick & NETFLOW_TW_MASK;
+        head = &t->tw_l0[c->tw_slot];
+    } else {
+        /* beyond level 1: park in its last slot, requeued from there */
+        if ((tick >> NETFLOW_TW_BITS) - (t->tw_now >> NETFLOW_TW_BITS) >= NETFLOW_TW_SLOTS)
+            tick = t->tw_now + ((uint64_t)NETFLOW_TW_MASK << NETFLOW_TW_BITS);
+        c->tw_slot = NETFLOW_TW_SLOTS + ((tick >> NETFLOW_TW_BITS) & NETFLOW_TW_MASK);
+        head = &t->tw_l1[c->tw_slot - NETFLOW_TW_SLOTS];
+    }
+
+    c->tw_prev = NETFLOW_TW_NIL;
+    c->tw_next = *head;
+    if (*head != NETFLOW_TW_NIL)
+        t->cold[*head].tw_prev = bkt - t->pool;
+    *head = bkt - t->pool;
+}
+
+/* Take the first bucket off a wheel list */
+static inline void
+netflow_tw_pop(struct rte_table_netflow *t, uint32_t *head, const hashBucket_cold_t *c)
+{
+    *head = c->tw_next;
+    if (*head != NETFLOW_TW_NIL)
+        t->cold[*head].tw_prev = NETFLOW_TW_NIL;
+}
+
+/*
+ * Take a bucket off the wheel wherever it is. A level 1 list on its way
+ * down keeps the old tw_slot of its buckets, its head is tw_cascade.
+ */
+static inline void
+netflow_tw_unlink(struct rte_table_netflow *t, const hashBucket_t *bkt)
+{
+    const hashBucket_cold_t *c = rte_table_netflow_cold(t, bkt);
+    uint32_t idx = bkt - t->pool;
+
+    if (c->tw_prev != NETFLOW_TW_NIL)
+        t->cold[c->tw_prev].tw_next = c->tw_next;
+    else if (t->tw_cascade == idx)
+        t->tw_cascade = c->tw_next;
+    else if (c->tw_slot < NETFLOW_TW_SLOTS)
+        t->tw_l0[c->tw_slot] = c->tw_next;
+    else
+        t->tw_l1[c->tw_slot - NETFLOW_TW_SLOTS] = c->tw_next;
+    if (c->tw_next != NETFLOW_TW_NIL)
+        t->cold[c->tw_next].tw_prev = c->tw_prev;
+}
+
+/* Take a bucket out of whichever of its two sets holds it */
+static inline void
+netflow_set_remove(struct rte_table_netflow *t, const hashBucket_t *bkt, uint32_t hash)
+{
+    uint32_t set_idx = hash & t->set_mask;
+    uint16_t sig = netflow_sig(hash);
+    uint32_t i, m, way;
+
+    for (i = 0; i < 2; i++) {
+        m = netflow_set_match(&t->sets[set_idx], _mm_set1_epi16(sig));
+        while (m) {
+            way = __builtin_ctz(m) >> 1;
+            if (t->sets[set_idx].bkt[way] == bkt) {
+                netflow_set_clear(t, set_idx, way);
+                return;
+            }
+            m &= ~(3U << (way << 1));
+        }
+        set_idx = netflow_alt_set(t, set_idx, sig);
+    }
+}
+
+/*
+ * List a bucket the first time it is updated in the current epoch. A bucket
+ * expired and recycled within the epoch is listed already: the entry stands
+ * for whichever flow holds the bucket when the exporter walks the list.
+ */
+static inline void
+netflow_dirty(struct rte_table_netflow *t, hashBucket_t *bkt)
+{
+    uint32_t e = t->epoch & 1;
+
+    bkt->dirty_epoch = t->epoch;
+    if (bkt->dirty_listed == t->epoch)
+        return;
+    bkt->dirty_listed = t->epoch;
+    if (unlikely(t->n_dirty[e] == t->n_entries)) {
+        t->n_dirty_overflow++;
+        return;
+    }
+    t->dirty[e][t->n_dirty[e]++] = bkt - t->pool;
+}
+
+/*
+ * Offer a heavy, long-lived flow a MARK rule: take a free slot and queue it
+ * to the controller. Only IPv4 TCP and UDP flows of untagged frames, which
+ * is what the rule matches.
+ */
+static void
+netflow_mark_offer(struct rte_table_netflow *t, hashBucket_t *bkt,
+        const union rte_table_netflow_key *k, const struct rte_table_netflow_pkt *pkt)
+{
+    hashBucket_cold_t *c = rte_table_netflow_cold(t, bkt);
+    struct rte_table_netflow_mark *mk;
+    uint32_t i, slot = 0;
+
+    if (c->mark_slot != 0 || pkt->addr6 != NULL || k->tunnel != NETFLOW_TUNNEL_NONE ||
+        k->vlanId != 0 || (k->proto != IPPROTO_TCP && k->proto != IPPROTO_UDP) ||
+        t->now - bkt->firstSeenSent < t->mark_min_age)
+        return;
+
+    for (i = 0; i < NETFLOW_MARK_SCAN; i++) {
+        slot = (t->mark_next + i) & (t->n_marks - 1);
+        if (t->marks[slot].state == NETFLOW_MARK_FREE)
+            break;
+    }
+    if (i == NETFLOW_MARK_SCAN) {
+        t->n_mark_full++;
+        return;
+    }
+    t->mark_next = slot + 1;
+
+    mk = &t->marks[slot];
+    mk->key = *k;
+    mk->bkt = bkt;
+    mk->gen++;
+    mk->id = t->mark_base | (uint32_t)mk->gen << NETFLOW_MARK_SLOT_BITS | slot;
+    mk->port = t->rx_port;
+    mk->queue = t->rx_queue;
+    mk->state = NETFLOW_MARK_ACTIVE;
+    /* never full: a slot has at most its add and its removal queued */
+    rte_ring_sp_enqueue(t->mark_ring, (void *)(uintptr_t)slot);
+    c->mark_slot = slot + 1;
+}
+
+/* The flow of a slot expired: stop accounting its id, have the rule removed */
+static void
+netflow_mark_release(struct rte_table_netflow *t, hashBucket_cold_t *c)
+{
+    uint32_t slot = c->mark_slot - 1;
+
+    t->marks[slot].bkt = NULL;
+    t->marks[slot].state = NETFLOW_MARK_DYING;
+    c->mark_slot = 0;
+    rte_ring_sp_enqueue(t->mark_ring, (void *)(uintptr_t)(slot | NETFLOW_MARK_OP_DEL));
+}
+
+/* The longest idle bucket of a set, or NULL if it is empty */
+static inline hashBucket_t *
+netflow_set_oldest(const struct rte_table_netflow_set *s)
+{
+    hashBucket_t *bkt, *oldest = NULL;
+    int way;
+
+    for (way = 0; way < NETFLOW_SET_WAYS; way++) {
+        bkt = s->bkt[way];
+        if (bkt != NULL && (oldest == NULL || bkt->lastSeenSent < oldest->lastSeenSent))
+            oldest = bkt;
+    }
+    return oldest;
+}
+
+/*
+ * Export a flow before its deadline to make room, flagged bucket_expired:
+ * off its set and the wheel, onto the export ring. Returns -1 if the
+ * exporter is backed up and the flow stays.
+ */
+static int
+netflow_evict(struct rte_table_netflow *t, hashBucket_t *bkt)
+{
+    hashBucket_cold_t *c = rte_table_netflow_cold(t, bkt);
+
+    bkt->bucket_expired = 1;
+    bkt->dirty_epoch = 0;
+    if (rte_ring_sp_enqueue(t->export_ring, bkt) != 0) {
+        bkt->bucket_expired = 0;
+        return -1;
+    }
+    netflow_tw_unlink(t, bkt);
+    netflow_set_remove(t, bkt, c->hash);
+    if (c->mark_slot != 0)
+        netflow_mark_release(t, c);
+    t->n_flows--;
+    t->n_evicted++;
+    return 0;
+}
+
+/*
+ * Emergency early export: while fewer than evict_reserve buckets are free,
+ * sweep the sets like a clock hand, EVICT_BUDGET per call, and evict the
+ * longest idle bucket of each if it went EVICT_MIN_IDLE_MS without a
+ * packet. The pool never grows, so under a flood of new flows the oldest
+ * idle ones leave early instead of the new ones being dropped.
+ */
+static void
+netflow_evict_sweep(struct rte_table_netflow *t, uint64_t curr)
+{
+    hashBucket_t *bkt;
+    uint32_t budget;
+
+    if (likely(t->n_free + rte_ring_count(t->return_ring) >= t->evict_reserve))
+        return;
+
+    for (budget = EVICT_BUDGET; budget; budget--) {
+        bkt = netflow_set_oldest(&t->sets[t->evict_hand]);
+        t->evict_hand = (t->evict_hand + 1) & t->set_mask;
+        if (bkt == NULL || curr - bkt->lastSeenSent < t->evict_min_idle)
+            continue;
+        if (netflow_evict(t, bkt) < 0)
+            break;
+    }
+}
+
+/*
+ * Counter of every count-min row of a key, as flat indexes into cm[][]:
+ * lane r is h + r * h2 of one CRC32, h2 its halves swapped, so a second
+ * key meets this one in all rows only if 24 bits of their hashes agree.
+ */
+static __rte_always_inline __m128i
+netflow_sketch_idx(const union rte_table_netflow_key *k)
+{
+    const __m128i row = _mm_set_epi32(3, 2, 1, 0);
+    const __m128i base = _mm_set_epi32(3 * NETFLOW_SKETCH_COLS, 2 * NETFLOW_SKETCH_COLS,
+            NETFLOW_SKETCH_COLS, 0);
+    uint64_t w[2];
+    uint32_t h, h2;
+
+    _mm_storeu_si128((__m128i *)w, k->xmm);
+    h = rte_hash_crc_8byte(w[1], rte_hash_crc_8byte(w[0], NETFLOW_SKETCH_SEED));
+    h2 = (h >> 16 | h << 16) | 1;
+    return _mm_add_epi32(base, _mm_and_si128(
+            _mm_add_epi32(_mm_set1_epi32(h), _mm_mullo_epi32(_mm_set1_epi32(h2), row)),
+            _mm_set1_epi32(NETFLOW_SKETCH_COLS - 1)));
+}
+
+/* The counters at idx, one per lane */
+static __rte_always_inline __m128i
+netflow_sketch_gather(const uint32_t *cm, __m128i idx)
+{
+#ifdef __AVX2__
+    return _mm_i32gather_epi32((const int *)cm, idx, 4);
+#else
+    return _mm_set_epi32(cm[_mm_extract_epi32(idx, 3)], cm[_mm_extract_epi32(idx, 2)],
+            cm[_mm_extract_epi32(idx, 1)], cm[_mm_extract_epi32(idx, 0)]);
+#endif
+}
+
+/* The lowest lane of v, in every lane */
+static __rte_always_inline __m128i
+netflow_sketch_min(__m128i v)
+{
+    v = _mm_min_epu32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_min_epu32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+/* Find the lowest estimate of a full top[] again */
+static void
+netflow_sketch_top_min(struct rte_table_netflow_sketch_bank *b)
+{
+    uint32_t i, m = 0;
+
+    for (i = 1; i < b->n_top; i++)
+        if (b->top[i].pkts < b->top[m].pkts)
+            m = i;
+    b->top_min_idx = m;
+    b->top_min = b->top[m].pkts;
+}
+
+/*
+ * Count a packet in the sketch: conservative update, only the rows at the
+ * key's minimum go up, one gather and one max for all rows. The key takes
+ * the place of the lowest of top[] when its estimate passes it.
+ */
+static inline void
+netflow_sketch_add(struct rte_table_netflow *t, const union rte_table_netflow_key *k,
+        const struct rte_table_netflow_pkt *pkt)
+{
+    struct rte_table_netflow_sketch_bank *b = &t->sketch->bank[t->sketch->epoch & 1];
+    uint32_t *cm = &b->cm[0][0];
+    struct rte_table_netflow_topk *e;
+    __m128i idx, v, est;
+    uint32_t n, i;
+
+    idx = netflow_sketch_idx(k);
+    v = netflow_sketch_gather(cm, idx);
+    est = _mm_add_epi32(netflow_sketch_min(v), _mm_set1_epi32(1));
+    v = _mm_max_epu32(v, est);
+    cm[_mm_extract_epi32(idx, 0)] = _mm_extract_epi32(v, 0);
+    cm[_mm_extract_epi32(idx, 1)] = _mm_extract_epi32(v, 1);
+    cm[_mm_extract_epi32(idx, 2)] = _mm_extract_epi32(v, 2);
+    cm[_mm_extract_epi32(idx, 3)] = _mm_extract_epi32(v, 3);
+    b->n_pkts++;
+
+    n = _mm_cvtsi128_si32(est);
+    if (b->n_top == NETFLOW_SKETCH_TOPK && n <= b->top_min)
+        return;
+
+    for (i = 0; i < b->n_top; i++)
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(b->top[i].key.xmm, k->xmm)) == 0xffff &&
+            (pkt->addr6 == NULL || netflow_addr6_equal(&b->top[i].addr6, pkt->addr6)))
+            break;
+    if (i == b->n_top) {
+        /* a new heavy key, in a free entry or instead of the lowest */
+        i = (b->n_top < NETFLOW_SKETCH_TOPK) ? b->n_top++ : b->top_min_idx;
+        e = &b->top[i];
+        e->key.xmm = k->xmm;
+        if (pkt->addr6 != NULL)
+            e->addr6 = *pkt->addr6;
+        e->bytes = 0;
+    }
+    e = &b->top[i];
+    e->pkts = n;
+    e->bytes += pkt->l3_len;
+    if (b->n_top == NETFLOW_SKETCH_TOPK && (i == b->top_min_idx || b->top_min == 0))
+        netflow_sketch_top_min(b);
+}
+
+/* Account one packet whose key is already hashed */
+static inline int
+netflow_entry_update(
+    struct rte_table_netflow *t,
+    union rte_table_netflow_key *k,
+    const struct rte_table_netflow_pkt *pkt,
+    uint32_t idx)
+{
+    struct rte_table_netflow_set *s;
     hashBucket_t *bucket = NULL;
     hashBucket_t *bkt = NULL;
-    uint32_t idx = 0;
-    uint8_t updated = 0; 
-    uint8_t notfound = 0; 
-    struct timeval curr;
+    hashBucket_cold_t *c;
+    uint32_t prim, set_idx;
+    uint16_t sig;
+    __m128i sig_x;
+    int way;
 
 #if DEBUG
   	printf ("src_ip = %d\n", k->ip_src);
@@ -128,105 +850,453 @@ rte_table_netflow_entry_add(
 	printf ("src_port = %d\n", k->port_src);
 	printf ("dst_port = %d\n", k->port_dst);
 #endif
-    /* hashing with SSE4_2 CRC32 */ 
-    idx = rte_hash_crc_4byte(k->proto, idx);
-    idx = rte_hash_crc_4byte(k->ip_src, idx);
-    idx = rte_hash_crc_4byte(k->ip_dst, idx);
-    idx = rte_hash_crc_4byte(k->port_src, idx);
-    idx = rte_hash_crc_4byte(k->port_dst, idx);
-    idx = idx % t->n_entries;
-    
-    /****************************************************************
-     * Lock one entry (t->array[idx]'s lock = t->lock[idex]
-     *
-     * So netflow_export can use other entries 
-     ****************************************************************/
-    rte_spinlock_lock(&t->lock[idx]);
- 
-    bucket = t->array[idx];
-    previous_pointer = bucket;
-    
-    while (bucket != NULL) {
-        /* Find same flow in the bucket's list */
-        if ((bucket->ip_src == k->ip_src) && (bucket->ip_dst == k->ip_dst) ) {
-            /* accumulated ToS Field */
-            bucket->src2dstTos |= ip->type_of_service;
-
-            /* accumulated TCP Flags */
-            if (k->proto == IPPROTO_TCP) {
-                tcp = (struct tcp_hdr *)((unsigned char*)ip + sizeof(struct ipv4_hdr));
-                bucket->src2dstTcpFlags |= tcp->tcp_flags;
-            }
+    if (t->sketch != NULL)
+        netflow_sketch_add(t, k, pkt);
 
-            /* accumulated Bytes */
-            /* TODO: if bytesSent > 2^32, netflow v5 value is wrong
-             *  since, netflow v5 dOctet is 32bit.
-             */
-            bucket->bytesSent += rte_cpu_to_be_16(ip->total_length);
-            bucket->pktSent++;
+    prim = idx & t->set_mask;
+    sig = netflow_sig(idx);
+    sig_x = _mm_set1_epi16(sig);
 
-            /* Time */
-            gettimeofday(&curr, NULL);
-            bucket->lastSeenSent = curr;
+    s = &t->sets[prim];
+    bucket = netflow_set_lookup(t, s, sig_x, k, pkt);
+    if (bucket == NULL && s->n_displaced)
+        bucket = netflow_set_lookup(t, &t->sets[netflow_alt_set(t, prim, sig)], sig_x, k, pkt);
 
-            updated = 1;
-            break;
+    if (bucket != NULL) {
+        /* accumulated ToS Field */
+        bucket->src2dstTos |= pkt->tos;
+
+        /* accumulated TCP Flags */
+        bucket->src2dstTcpFlags |= pkt->tcp_flags;
+
+        /* accumulated Bytes, v5 truncates them to 32 bit, v9/IPFIX do not */
+        bucket->bytesSent += pkt->l3_len;
+        bucket->pktSent++;
+
+        /* Time */
+        bucket->lastSeenSent = t->now;
+
+        if (bucket->dirty_epoch != t->epoch)
+            netflow_dirty(t, bucket);
+
+        if (unlikely((bucket->pktSent & (NETFLOW_MARK_PKTS - 1)) == 0) && t->marks != NULL)
+            netflow_mark_offer(t, bucket, k, pkt);
+    } else {
+        way = netflow_set_find_slot(t, prim, sig, &set_idx);
+        if (unlikely(way < 0)) {
+            /* make room: the longest idle flow of the set goes, unless it is
+             * in this very burst too */
+            bkt = netflow_set_oldest(s);
+            if (bkt != NULL && bkt->lastSeenSent != t->now && netflow_evict(t, bkt) == 0)
+                way = netflow_set_find_slot(t, prim, sig, &set_idx);
+        }
+        if (unlikely(way < 0)) {
+            t->n_add_fail++;
+            t->n_pkts++;
+            return 0;
         }
-        printf("Bucket collision\n");
-        notfound = 1;
-        previous_pointer = bucket;
-        bucket = bucket->next;
-    }
 
-    if( !updated ) {
         /* Create New Bucket */
         //printf("First Seen : %" PRIu32 "\n", idx);
-        bkt = (hashBucket_t *)rte_zmalloc("BUCKET", sizeof(hashBucket_t), RTE_CACHE_LINE_SIZE);
+        bkt = netflow_bucket_get(t);
+        if (unlikely(bkt == NULL)) {
+            t->n_pkts++;
+            return 0;
+        }
+        bkt->xmm = k->xmm;
         bkt->magic = 1;
-        bkt->vlanId     = k->vlanId;
-        bkt->proto      = k->proto;
-        bkt->ip_src     = k->ip_src;
-        bkt->ip_dst     = k->ip_dst;
-        bkt->port_src   = k->port_src;
-        bkt->port_dst   = k->port_dst;
+        if (pkt->addr6 != NULL)
+            *rte_table_netflow_addr6(t, bkt) = *pkt->addr6;
+        if (k->tunnel != NETFLOW_TUNNEL_NONE) {
+            c = rte_table_netflow_cold(t, bkt);
+            c->tun_id = pkt->tun_id;
+            c->tun_src = pkt->tun_src;
+            c->tun_dst = pkt->tun_dst;
+        }
     
         /* ToS Field */
-        bkt->src2dstTos = ip->type_of_service; 
+        bkt->src2dstTos = pkt->tos; 
         
         /* TCP Flags */
-        if (k->proto == IPPROTO_TCP) {
-            tcp = (struct tcp_hdr *)((unsigned char*)ip + sizeof(struct ipv4_hdr));
-            bkt->src2dstTcpFlags = tcp->tcp_flags;
-
-            /* TODO: If TCP flags is start of Flow (Syn) 
-             * Save payload of DPI 
-             */
+        bkt->src2dstTcpFlags = pkt->tcp_flags;
 
-            /* If Flags is FIN, check and of flow */
-        }
+        /* TODO: If TCP flags is start of Flow (Syn) 
+         * Save payload of DPI 
+         */
 
         /* Bytes (Total number of Layer 3 bytes)  */
-        bkt->bytesSent = rte_cpu_to_be_16(ip->total_length);
+        bkt->bytesSent = pkt->l3_len;
         bkt->pktSent++;
 
         /* Time */
-        gettimeofday(&curr, NULL);
-        bkt->firstSeenSent = bkt->lastSeenSent = curr; 
+        bkt->firstSeenSent = bkt->lastSeenSent = t->now;
         
-        /* Update contents of bucket */
-        if (notfound) previous_pointer->next = bkt;
-        else t->array[idx] = bkt;
+        if (set_idx != prim) {
+            s->n_displaced++;
+            t->n_displaced++;
+        }
+        netflow_set_fill(&t->sets[set_idx], way, sig, bkt, set_idx != prim);
+        c = rte_table_netflow_cold(t, bkt);
+        c->hash = idx;
+        c->port = t->rx_port;
+        netflow_tw_insert(t, bkt);
+        netflow_dirty(t, bkt);
+        t->n_flows++;
     }
     
-    rte_spinlock_unlock(&t->lock[idx]);
-    /***********************************************************************
-     * End of entry lock
-     * release lock
-     **********************************************************************/
-    global_packet_count++;
+    t->n_pkts++;
+    return 1;
+}
+
+int
+rte_table_netflow_entry_add(
+    void *table,
+    void *key,
+    void *entry)
+{
+    struct rte_table_netflow *t = (struct rte_table_netflow *)table;
+    union rte_table_netflow_key *k = key;
+
+    struct rte_table_netflow_pkt *pkt = entry;
+
+    return netflow_entry_update(t, k, pkt,
+            pkt->has_rss ? netflow_hash_rss(t, k, pkt->rss) : netflow_hash(t, k));
+}
+
+/*
+ * Account a burst of parsed packets in stages, so the table's cache misses
+ * overlap instead of stalling one packet at a time: hash every key and
+ * prefetch its primary set, then match signatures and prefetch the
+ * candidate buckets, then update. Keys that only hit in their alternative
+ * set, and new flows, still miss in the last stage.
+ *
+ * Returns the number of packets accounted.
+ */
+int
+rte_table_netflow_entry_add_bulk(
+    void *table,
+    union rte_table_netflow_key *keys,
+    struct rte_table_netflow_pkt *pkts,
+    uint32_t n_keys)
+{
+    struct rte_table_netflow *t = (struct rte_table_netflow *)table;
+    const struct rte_table_netflow_set *s;
+    uint32_t hash[NETFLOW_BULK_MAX];
+    uint32_t base, n, i, m;
+    int added = 0;
+
+    for (base = 0; base < n_keys; base += n) {
+        n = RTE_MIN(n_keys - base, (uint32_t)NETFLOW_BULK_MAX);
+
+        netflow_hash_bulk(t, &keys[base], &pkts[base], n, hash);
+        for (i = 0; i < n; i++)
+            rte_prefetch0(&t->sets[hash[i] & t->set_mask]);
+
+        for (i = 0; i < n; i++) {
+            s = &t->sets[hash[i] & t->set_mask];
+            m = netflow_set_match(s, _mm_set1_epi16(netflow_sig(hash[i])));
+            if (m)
+                rte_prefetch0(s->bkt[__builtin_ctz(m) >> 1]);
+        }
+
+        for (i = 0; i < n; i++)
+            added += netflow_entry_update(t, &keys[base + i], &pkts[base + i], hash[i]);
+    }
+
+    return added;
+}
+
+/*
+ * Account a packet the NIC marked with the id of a flow of this shard,
+ * without parsing it past the IPv4 header nor looking the flow up. l3 is
+ * its IPv4 header, with len bytes of the segment from there.
+ *
+ * Returns 1 if accounted, 0 if the id is not (or no longer) one of this
+ * shard's and the packet has to be classified as usual.
+ */
+int
+rte_table_netflow_mark_account(void *table, uint32_t id, const uint8_t *l3, uint32_t len)
+{
+    struct rte_table_netflow *t = (struct rte_table_netflow *)table;
+    const struct ipv4_hdr *ip = (const struct ipv4_hdr *)l3;
+    const struct tcp_hdr *tcp;
+    struct rte_table_netflow_mark *mk;
+    hashBucket_t *bkt;
+    uint32_t ihl;
+
+    if (len < sizeof(struct ipv4_hdr))
+        return 0;
+    ihl = (ip->version_ihl & 0x0f) * 4;
+    if (ihl < sizeof(struct ipv4_hdr) || ihl > len)
+        return 0;
+    if (t->marks == NULL ||
+        (id & ~((1U << NETFLOW_MARK_SHARD_SHIFT) - 1)) != t->mark_base)
+        return 0;
+    mk = &t->marks[id & (t->n_marks - 1)];
+    bkt = mk->bkt;
+    if (mk->id != id || bkt == NULL)
+        return 0;
+
+    bkt->src2dstTos |= ip->type_of_service;
+    if (bkt->proto == IPPROTO_TCP && ihl + offsetof(struct tcp_hdr, rx_win) <= len) {
+        tcp = (const struct tcp_hdr *)(l3 + ihl);
+        bkt->src2dstTcpFlags |= tcp->tcp_flags;
+    }
+    if (t->sketch != NULL) {
+        struct rte_table_netflow_pkt pkt = { .l3_len = rte_be_to_cpu_16(ip->total_length) };
+
+        netflow_sketch_add(t, &mk->key, &pkt);
+    }
+    bkt->bytesSent += rte_be_to_cpu_16(ip->total_length);
+    bkt->pktSent++;
+    bkt->lastSeenSent = t->now;
+    if (bkt->dirty_epoch != t->epoch)
+        netflow_dirty(t, bkt);
+
+    t->n_mark_pkts++;
+    t->n_pkts++;
     return 1;
 }
 
+/*
+ * Let heavy flows of the shard get MARK rules: n_slots (a power of two, up
+ * to NETFLOW_MARK_MAX_SLOTS) rules at most, ids tagged with shard. The
+ * controller serves the requests on mark_ring, see netflow-offload.c.
+ */
+int
+rte_table_netflow_mark_enable(void *table, uint32_t shard, uint32_t n_slots, int socket_id)
+{
+    struct rte_table_netflow *t = (struct rte_table_netflow *)table;
+    char ring_name[RTE_RING_NAMESIZE];
+
+    if (!rte_is_power_of_2(n_slots) || n_slots > NETFLOW_MARK_MAX_SLOTS ||
+        shard >= (1U << (24 - NETFLOW_MARK_SHARD_SHIFT)))
+        return -EINVAL;
+
+    t->marks = rte_zmalloc_socket("NETFLOW_MARKS",
+            n_slots * sizeof(struct rte_table_netflow_mark), RTE_CACHE_LINE_SIZE, socket_id);
+    snprintf(ring_name, sizeof(ring_name), "NETFLOW_MARK_%u", shard);
+    t->mark_ring = rte_ring_create(ring_name, rte_align32pow2(2 * n_slots + 1), socket_id,
+            RING_F_SP_ENQ | RING_F_SC_DEQ);
+    if (t->marks == NULL || t->mark_ring == NULL) {
+        RTE_LOG(ERR, TABLE, "%s: Cannot allocate %u MARK slots\n", __func__, n_slots);
+        rte_ring_free(t->mark_ring);
+        rte_free(t->marks);
+        t->marks = NULL;
+        t->mark_ring = NULL;
+        return -ENOMEM;
+    }
+    t->n_marks = n_slots;
+    t->mark_base = shard << NETFLOW_MARK_SHARD_SHIFT;
+    t->mark_min_age = NETFLOW_MARK_MIN_AGE * rte_get_tsc_hz();
+    return 0;
+}
+
+/* Feed every packet of the shard to a heavy hitter sketch */
+int
+rte_table_netflow_sketch_enable(void *table, int socket_id)
+{
+    struct rte_table_netflow *t = (struct rte_table_netflow *)table;
+
+    t->sketch = rte_zmalloc_socket("NETFLOW_SKETCH", sizeof(struct rte_table_netflow_sketch),
+            RTE_CACHE_LINE_SIZE, socket_id);
+    if (t->sketch == NULL) {
+        RTE_LOG(ERR, TABLE, "%s: Cannot allocate the sketch\n", __func__);
+        return -ENOMEM;
+    }
+    t->sketch->epoch = t->sketch->epoch_req = t->sketch->epoch_read = 1;
+    return 0;
+}
+
+/* Empty a bank no one counts into, for the owner to switch to */
+static void
+netflow_sketch_clear(struct rte_table_netflow_sketch_bank *b)
+{
+    memset(b->cm, 0, sizeof(b->cm));
+    b->n_top = b->top_min = b->top_min_idx = 0;
+    b->n_pkts = 0;
+}
+
+/*
+ * Reader side of the sketch: have the owner start counting into the other
+ * bank and return the one it closed, to be handed back with
+ * rte_table_netflow_sketch_release() once read. Waits briefly for the owner
+ * lcore to switch banks, NULL if it did not; a switch still pending is
+ * waited for again on the next call.
+ */
+#define NETFLOW_SKETCH_WAIT_US  1000
+
+const struct rte_table_netflow_sketch_bank *
+rte_table_netflow_sketch_close(void *table)
+{
+    struct rte_table_netflow *t = (struct rte_table_netflow *)table;
+    struct rte_table_netflow_sketch *sk = t->sketch;
+    uint32_t e = sk->epoch_req, wait;
+
+    if (sk->epoch == e) {
+        /* a switch that came in late closed a bank no one read: drop it */
+        if (sk->epoch_read != e) {
+            netflow_sketch_clear(&sk->bank[(e - 1) & 1]);
+            sk->epoch_read = e;
+        }
+        rte_smp_wmb();
+        sk->epoch_req = ++e;
+    }
+    for (wait = 0; sk->epoch != e; wait++) {
+        if (wait == NETFLOW_SKETCH_WAIT_US)
+            return NULL;
+        rte_delay_us(1);
+    }
+    rte_smp_rmb();
+    sk->epoch_read = e;
+    return &sk->bank[(e - 1) & 1];
+}
+
+/* Clear the bank the last rte_table_netflow_sketch_close() returned */
+void
+rte_table_netflow_sketch_release(void *table)
+{
+    struct rte_table_netflow_sketch *sk = ((struct rte_table_netflow *)table)->sketch;
+
+    netflow_sketch_clear(&sk->bank[(sk->epoch_read - 1) & 1]);
+}
+
+/* Count-min estimate of a key in a bank, or in the sum of several */
+uint32_t
+rte_table_netflow_sketch_estimate(const struct rte_table_netflow_sketch_bank *b,
+        const union rte_table_netflow_key *k)
+{
+    return _mm_cvtsi128_si32(netflow_sketch_min(netflow_sketch_gather(&b->cm[0][0],
+            netflow_sketch_idx(k))));
+}
+
+/*
+ * Advance the timing wheel to the current tick and hand buckets past their
+ * idle or lifetime timeout (or flagged bucket_expired) to the exporter.
+ * At most EXPIRE_BUDGET wheel entries are handled per call, so the work is
+ * bounded and proportional to the flows coming due, not to the table size.
+ * Only the owner lcore may call this.
+ *
+ * Returns the number of buckets expired.
+ */
+uint32_t
+rte_table_netflow_expire(void *table)
+{
+    struct rte_table_netflow *t = (struct rte_table_netflow *)table;
+    hashBucket_cold_t *c;
+    hashBucket_t *bkt;
+    uint64_t curr, target;
+    uint32_t budget = EXPIRE_BUDGET, n = 0;
+    uint32_t *head;
+
+    /* the exporter wants the dirty list: publish it and start the next one */
+    if (unlikely(t->epoch_req != t->epoch)) {
+        rte_smp_wmb();
+        t->epoch = t->epoch_req;
+    }
+
+    /* the reader wants the sketch: count into the other bank, it cleared it */
+    if (t->sketch != NULL && unlikely(t->sketch->epoch_req != t->sketch->epoch)) {
+        rte_smp_wmb();
+        t->sketch->epoch = t->sketch->epoch_req;
+    }
+
+    curr = rte_rdtsc();
+    target = curr / t->tw_tick;
+    netflow_evict_sweep(t, curr);
+
+    while (budget) {
+        if (t->tw_cascade != NETFLOW_TW_NIL) {
+            head = &t->tw_cascade;
+        } else {
+            head = &t->tw_l0[t->tw_now & NETFLOW_TW_MASK];
+            if (*head == NETFLOW_TW_NIL) {
+                if (t->tw_now >= target)
+                    break;
+                /* next tick, pulling down a level 1 slot every 256 */
+                if ((++t->tw_now & NETFLOW_TW_MASK) == 0) {
+                    head = &t->tw_l1[(t->tw_now >> NETFLOW_TW_BITS) & NETFLOW_TW_MASK];
+                    t->tw_cascade = *head;
+                    *head = NETFLOW_TW_NIL;
+                }
+                continue;
+            }
+        }
+
+        budget--;
+        bkt = &t->pool[*head];
+        c = rte_table_netflow_cold(t, bkt);
+
+        if (bkt->bucket_expired == 0 && curr < netflow_deadline(t, bkt)) {
+            netflow_tw_pop(t, head, c);
+            netflow_tw_insert(t, bkt);
+            continue;
+        }
+
+        /* exporter is backed up, retry this bucket next time */
+        bkt->dirty_epoch = 0;
+        if (rte_ring_sp_enqueue(t->export_ring, bkt) != 0)
+            break;
+        netflow_tw_pop(t, head, c);
+        netflow_set_remove(t, bkt, c->hash);
+        if (c->mark_slot != 0)
+            netflow_mark_release(t, c);
+        t->n_flows--;
+        t->n_expired++;
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Exporter side of the dirty tracking: close the owner's current epoch and
+ * call f on every bucket updated in it, once. Buckets updated again since,
+ * or expired (dirty_epoch reset to 0), are skipped; they are seen in the
+ * next walk or by the expiry path. The list holds a pool index at most
+ * once per epoch, see netflow_dirty(). Waits briefly for the owner lcore to
+ * switch lists.
+ *
+ * Returns the number of buckets listed, or -EAGAIN if the owner did not
+ * switch in time; the next call picks up where this one stopped.
+ */
+#define NETFLOW_DIRTY_WAIT_US   1000
+
+int
+rte_table_netflow_dirty_walk(void *table, rte_table_netflow_op_dirty f, void *arg)
+{
+    struct rte_table_netflow *t = (struct rte_table_netflow *)table;
+    uint32_t e = t->export_epoch;
+    uint32_t i, n, wait;
+    const uint32_t *list;
+    hashBucket_t *bkt;
+
+    if (t->epoch_req == e)
+        t->epoch_req = e + 1;
+    for (wait = 0; t->epoch != e + 1; wait++) {
+        if (wait == NETFLOW_DIRTY_WAIT_US)
+            return -EAGAIN;
+        rte_delay_us(1);
+    }
+    rte_smp_rmb();
+
+    list = t->dirty[e & 1];
+    n = t->n_dirty[e & 1];
+    for (i = 0; i < n; i++) {
+        if (i + 4 < n)
+            rte_prefetch0(&t->pool[list[i + 4]]);
+        bkt = &t->pool[list[i]];
+        if (bkt->dirty_epoch == e)
+            f(t, bkt, arg);
+    }
+
+    /* hand the list back empty before the owner may switch to it again */
+    t->n_dirty[e & 1] = 0;
+    rte_smp_wmb();
+    t->export_epoch = e + 1;
+    return n;
+}
+
 int
 rte_table_netflow_free(void *table)
 {
@@ -239,6 +1309,18 @@ rte_table_netflow_free(void *table)
     }
 
     /* Free previously allocated resources */
+    rte_ring_free(t->export_ring);
+    rte_ring_free(t->return_ring);
+    rte_ring_free(t->mark_ring);
+    rte_free(t->marks);
+    rte_free(t->sketch);
+    rte_free(t->dirty[0]);
+    rte_free(t->dirty[1]);
+    rte_free(t->free_bkts);
+    rte_free(t->addr6);
+    rte_free(t->exp);
+    rte_free(t->cold);
+    rte_free(t->pool);
     rte_free(t);
     return 0;
 }
@@ -262,16 +1344,15 @@ rte_table_print(void *table)
 	printf ("\nprinting flow table\n");
 	printf ("t->n_entries = %d\n", t->n_entries);
 	
-	for (unsigned int i = 0; i < t->n_entries; i++) {
-		rte_spinlock_lock(&t->lock[i]);
-		bkt = t->array[i];
+	for (unsigned int i = 0; i < t->n_sets * NETFLOW_SET_WAYS; i++) {
+		bkt = t->sets[i / NETFLOW_SET_WAYS].bkt[i % NETFLOW_SET_WAYS];
 		if (bkt != NULL) {
 			printf ("src_ip = %d\ndst_ip = %d\nsrc_port = %d\ndst_port = %d\nproto = %d\n",
 					bkt->ip_src, bkt->ip_dst, bkt->port_src, bkt->port_dst, bkt->proto);
 			printf ("bytes_sent = %ld\nbytes_recv = %ld\npackets_sent = %ld\npackets_recv = %ld\n\n",
-					bkt->bytesSent, bkt->bytesRcvd, bkt->pktSent, bkt->pktRcvd);
+					bkt->bytesSent, rte_table_netflow_cold(t, bkt)->bytesRcvd,
+					bkt->pktSent, rte_table_netflow_cold(t, bkt)->pktRcvd);
 		}
-        rte_spinlock_unlock(&t->lock[i]);
 	}
 
 	return 0;
@@ -279,37 +1360,82 @@ rte_table_print(void *table)
 
 
 void
-rte_table_print_packet_count (void) {
-   fprintf (stderr, "Total Packets Decoded: %lu\n", global_packet_count);
+rte_table_print_packet_count (struct rte_table_netflow **tables, unsigned int nb_tables) {
+   uint64_t total = 0;
+   uint64_t in_use = 0, capacity = 0, alloc_fail = 0;
+   struct rte_table_netflow *t;
+
+   for (unsigned int s = 0; s < nb_tables; s++) {
+      t = tables[s];
+      total += t->n_pkts;
+      in_use += t->n_entries - t->n_free - rte_ring_count(t->return_ring);
+      capacity += t->n_entries;
+      alloc_fail += t->n_alloc_fail;
+   }
+   fprintf (stderr, "Total Packets Decoded: %lu\n", total);
+   fprintf (stderr, "Buckets In Use: %lu/%lu, Allocation Failures: %lu\n",
+         in_use, capacity, alloc_fail);
 }
 
 
 int
-rte_table_print_stats(void *table)
+rte_table_print_stats(struct rte_table_netflow **tables, unsigned int nb_tables)
 {
-	struct rte_table_netflow *t = (struct rte_table_netflow *)table;
+	struct rte_table_netflow *t;
 	hashBucket_t *bkt;
 
    uint64_t total_bytes = 0;
    uint64_t total_pkts  = 0;
    uint64_t total_flows = 0;
+   uint64_t total_expired = 0;
+   uint64_t set_fill[NETFLOW_SET_WAYS + 1] = { 0 };
+   unsigned int used;
 
    printf ("\nprinting flow table statistics\n");
-   printf ("t->n_entries = %d\n", t->n_entries);
-
-   for (unsigned int i = 0; i < t->n_entries; i++) {
-      rte_spinlock_lock(&t->lock[i]);
-		bkt = t->array[i];
-		while (bkt != NULL) {
-         total_bytes += bkt->bytesSent;
-         total_pkts  += bkt->pktSent;
-         total_flows++;
-         bkt = bkt->next;
-		}
-      rte_spinlock_unlock(&t->lock[i]);
+
+   for (unsigned int s = 0; s < nb_tables; s++) {
+      t = tables[s];
+      printf ("shard %u: t->n_entries = %d%s\n", s, t->n_entries,
+            t->addr6 != NULL ? " (IPv6)" : "");
+      total_expired += t->n_expired;
+      printf ("shard %u: %lu displaced, %lu dropped (sets full)\n",
+            s, t->n_displaced, t->n_add_fail);
+      printf ("shard %u: pool %u/%u buckets in use, %lu dropped (pool empty)\n",
+            s, t->n_entries - t->n_free - rte_ring_count(t->return_ring),
+            t->n_entries, t->n_alloc_fail);
+      printf ("shard %u: dirty epoch %u, %lu updates not listed (list full)\n",
+            s, t->epoch, t->n_dirty_overflow);
+      if (t->n_evicted)
+         printf ("shard %u: %lu flows exported early to make room\n", s, t->n_evicted);
+      if (t->n_unsampled)
+         printf ("shard %u: %lu packets left out by sampling\n", s, t->n_unsampled);
+      if (t->marks != NULL)
+         printf ("shard %u: %lu packets accounted by MARK, %lu heavy flows without a slot\n",
+               s, t->n_mark_pkts, t->n_mark_full);
+
+      for (unsigned int i = 0; i < t->n_sets; i++) {
+         used = 0;
+         for (unsigned int way = 0; way < NETFLOW_SET_WAYS; way++) {
+            bkt = t->sets[i].bkt[way];
+            if (bkt == NULL)
+               continue;
+            total_bytes += bkt->bytesSent;
+            total_pkts  += bkt->pktSent;
+            total_flows++;
+            used++;
+         }
+         set_fill[used]++;
+      }
 	}
 
+   /* how evenly the hash spreads the flows */
+   printf ("set fill:");
+   for (unsigned int i = 0; i <= NETFLOW_SET_WAYS; i++)
+      printf (" %u:%lu", i, set_fill[i]);
+   printf ("\n");
+
    printf ("total flows = %lu\n", total_flows);
+   printf ("expired flows = %lu\n", total_expired);
    printf ("total bytes = %lu\n", total_bytes);
    printf ("total pkts  = %lu\n", total_pkts);
 
@@ -318,81 +1444,137 @@ rte_table_print_stats(void *table)
 }
 
 
-void rte_table_export_to_file (const char *filename) {
+/*
+ * Binary snapshot of the live flows, see netflow-snapshot.h. The file is
+ * sized for every bucket of every shard and mapped once. A bucket always
+ * has the same record, at its shard's base plus its pool index, so the
+ * exporter only rewrites the records of flows that changed
+ * (rte_table_snapshot_update) or expired (rte_table_snapshot_clear).
+ */
+struct rte_table_netflow_snapshot *
+rte_table_snapshot_create(const char *filename, struct rte_table_netflow **tables,
+        unsigned int nb_tables)
+{
+    struct rte_table_netflow_snapshot *snap;
+    struct netflow_snap_hdr *hdr;
+    struct timeval tv;
+    uint64_t capacity = 0;
+    unsigned int s;
 
-   int buf_size = EXPORT_BUF_INITAL_SIZE;
-   int fd;
-   int snp_res;
-   size_t buf_end_offset = 0;
-   char *buf;
-   const char *tmpfile = "/tmp/netflow-export-tmp.csv";
-   hashBucket_t *bucket;
-   struct in_addr src_addr;
-   struct in_addr dst_addr;
-   char src_ip_str[16];
-   char dst_ip_str[16];
+    snap = rte_zmalloc("SNAPSHOT", sizeof(*snap) + nb_tables * sizeof(snap->base[0]), 0);
+    if (snap == NULL)
+        return NULL;
+    for (s = 0; s < nb_tables; s++) {
+        snap->base[s] = capacity;
+        capacity += tables[s]->n_entries;
+    }
+    snap->size = sizeof(*hdr) + capacity * sizeof(struct netflow_snap_rec);
 
-   if ((buf = malloc (sizeof (char) * buf_size)) == NULL) {
-      printf ("malloc failed with %s\n", strerror (errno));
-      exit (1);
-   }
+    snap->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (snap->fd < 0 || ftruncate(snap->fd, snap->size) < 0) {
+        RTE_LOG(ERR, TABLE, "%s: %s: %s\n", __func__, filename, strerror(errno));
+        goto fail;
+    }
+    snap->hdr = mmap(NULL, snap->size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, snap->fd, 0);
+    if (snap->hdr == MAP_FAILED) {
+        RTE_LOG(ERR, TABLE, "%s: cannot map %s: %s\n", __func__, filename, strerror(errno));
+        snap->hdr = NULL;
+        goto fail;
+    }
+    snap->recs = (struct netflow_snap_rec *)(snap->hdr + 1);
 
-   for (unsigned int i = 0; i < table->n_entries; i++) {
-		rte_spinlock_lock(&table->lock[i]);
-		bucket = table->array[i];
-		while (bucket != NULL) {
-         /* Free space needed in buffer is maximum number of digits needed to represent
-          * an entry which is 91(including null byte) */
-         if ((buf_size - buf_end_offset) <= 91) {
-            if ((buf = realloc (buf, buf_size * 2)) == NULL) {
-               printf ("realloc failed with error %s\n", strerror (errno));
-               exit (1);
-            } else {
-               buf_size *= 2;
-            }
-         }
-         /* Need to copy the string here rather than use directly in the sprintf
-            because inet_ntoa return a static buffer that get written over on
-            subsequent calls */
-         src_addr.s_addr = bucket->ip_src;
-         dst_addr.s_addr = bucket->ip_dst;
-         strcpy(src_ip_str, inet_ntoa(src_addr));
-         strcpy(dst_ip_str, inet_ntoa(dst_addr));
-
-         snp_res = snprintf ((buf + buf_end_offset), 91, "%s,%s,%d,%d,%d,%lu,%lu\n",
-               src_ip_str,
-               dst_ip_str,
-               bucket->port_src,
-               bucket->port_dst,
-               bucket->proto,
-               bucket->bytesSent,
-               bucket->pktSent);
-         if (snp_res < 0) {
-            printf ("sprintf failed with %s\n", strerror (errno));
-            exit (1);
-         }
-         buf_end_offset += snp_res;
-         bucket = bucket->next;
-		}
-      rte_spinlock_unlock(&table->lock[i]);
-	}
+    hdr = snap->hdr;
+    gettimeofday(&tv, NULL);
+    hdr->tsc_base = rte_rdtsc();
+    hdr->time_base_ns = (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+    hdr->tsc_hz = rte_get_tsc_hz();
+    hdr->capacity = capacity;
+    hdr->n_records = capacity;
+    hdr->rec_size = sizeof(struct netflow_snap_rec);
+    hdr->version = NETFLOW_SNAP_VERSION;
+    rte_smp_wmb();
+    hdr->magic = NETFLOW_SNAP_MAGIC;
 
-   /* More effeciant to just do a single write */
-   if ((fd = open (tmpfile, O_WRONLY | O_CREAT, S_IRWXU | S_IRWXO)) < 0) { /* Returns non-negative integer on success */
-      printf ("open failed with error %s\n", strerror (errno));
-      exit (1);
-   }
+    return snap;
 
-   if((int)buf_end_offset != write (fd, buf, buf_end_offset)) {
-      printf ("write didn't return expected number of bytes\n");
-      exit (1);
-   }
+fail:
+    if (snap->fd >= 0)
+        close(snap->fd);
+    rte_free(snap);
+    return NULL;
+}
 
-   if (close (fd) != 0) { /* Returns 0 on success */
-      printf ("close failed with error %s\n", strerror (errno));
-      exit (1);
-   }
+/* Open and close a batch of record changes; readers retry across it */
+void
+rte_table_snapshot_begin(struct rte_table_netflow_snapshot *snap)
+{
+    snap->hdr->seq++;
+    rte_smp_wmb();
+}
+
+void
+rte_table_snapshot_end(struct rte_table_netflow_snapshot *snap)
+{
+    snap->hdr->snap_tsc = rte_rdtsc();
+    rte_smp_wmb();
+    snap->hdr->seq++;
+}
+
+/* Copy a live bucket into its record. Export lcore only, like every
+ * reader of live buckets: expired buckets are only recycled by that same
+ * lcore (netflow_export_poll), so nothing read here is reused under us. */
+void
+rte_table_snapshot_update(struct rte_table_netflow_snapshot *snap, unsigned int shard,
+        struct rte_table_netflow *t, const hashBucket_t *bkt)
+{
+    struct netflow_snap_rec *rec = &snap->recs[snap->base[shard] + (bkt - t->pool)];
 
-   rename (tmpfile, filename);
-   return;
+    if (t->addr6 != NULL) {
+        rec->family = 6;
+        memcpy(rec->ip6_src, rte_table_netflow_addr6(t, bkt)->src, sizeof(rec->ip6_src));
+        memcpy(rec->ip6_dst, rte_table_netflow_addr6(t, bkt)->dst, sizeof(rec->ip6_dst));
+    } else {
+        rec->family = 4;
+        rec->ip_src = bkt->ip_src;
+        rec->ip_dst = bkt->ip_dst;
+    }
+    rec->port_src = bkt->port_src;
+    rec->port_dst = bkt->port_dst;
+    rec->proto = bkt->proto;
+    rec->tos = bkt->src2dstTos;
+    rec->tcp_flags = bkt->src2dstTcpFlags;
+    rec->shard = shard;
+    rec->vlan = bkt->vlanId;
+    rec->tunnel = bkt->tunnel;
+    if (bkt->tunnel != NETFLOW_TUNNEL_NONE) {
+        const hashBucket_cold_t *c = rte_table_netflow_cold(t, bkt);
+
+        rec->tun_id = c->tun_id;
+        rec->tun_src = c->tun_src;
+        rec->tun_dst = c->tun_dst;
+    }
+    rec->bytes = bkt->bytesSent;
+    rec->pkts = bkt->pktSent;
+    rec->first_tsc = bkt->firstSeenSent;
+    rec->last_tsc = bkt->lastSeenSent;
+}
+
+/* Empty the record of an expired bucket */
+void
+rte_table_snapshot_clear(struct rte_table_netflow_snapshot *snap, unsigned int shard,
+        struct rte_table_netflow *t, const hashBucket_t *bkt)
+{
+    memset(&snap->recs[snap->base[shard] + (bkt - t->pool)], 0,
+            sizeof(struct netflow_snap_rec));
+}
+
+void
+rte_table_snapshot_free(struct rte_table_netflow_snapshot *snap)
+{
+    if (snap == NULL)
+        return;
+    munmap(snap->hdr, snap->size);
+    close(snap->fd);
+    rte_free(snap);
 }
@@ -9,7 +9,7 @@ extern "C" {
  * @file
  * RTE Table Netflow
  *
- * array indexing, Lookup key is the array entry index.
+ * Set-associative hashing of flow keys, see struct rte_table_netflow_set.
  *
  ***/
 
@@ -19,12 +19,26 @@ extern "C" {
 #include <rte_ip.h>
 #include <rte_udp.h>
 #include <rte_tcp.h>
-#include <rte_spinlock.h>
+#include <rte_ring.h>
+#include <rte_cycles.h>
 
 #include "rte_table.h"
+#include "netflow-snapshot.h"
 
 #define MAX_ENTRY       2 * 1024 * 1024
-#define EXPORT_BUF_INITAL_SIZE 1024
+
+#define EXPORT_RING_SIZE    64 * 1024       /* expired buckets in flight to the exporter */
+#define EXPIRE_BUDGET       64              /* wheel entries handled per rte_table_netflow_expire() */
+
+#define NETFLOW_BULK_MAX    64              /* keys hashed ahead by rte_table_netflow_entry_add_bulk() */
+
+#define IDLE_TIMEOUT 60
+#define LIFETIME_TIMEOUT 120
+
+/* Early export when the bucket pool runs low, see netflow_evict_sweep() */
+#define EVICT_RESERVE_SHIFT 5               /* keep n_entries >> this buckets free */
+#define EVICT_BUDGET        32              /* sets looked at per rte_table_netflow_expire() */
+#define EVICT_MIN_IDLE_MS   100             /* the sweep leaves flows seen since alone */
 
 /* ***************************************** */
 
@@ -73,36 +87,124 @@ typedef struct single_flow_ver5_rec {
   struct flow_ver5_rec flowRecord[V5FLOWS_PER_PAK+1 /* safe against buffer overflows */];
 } NetFlow5Record;
 
-typedef struct rte_table_hashBucket {
-    uint8_t magic;                                  /**< magic code for validation */
-    uint8_t bucket_expired;                         /**< force bucket to expire */
-    uint8_t vlanId;
-    uint8_t proto;
+/* ***************************************** */
 
-    uint32_t ip_src;                                /**< saved in network order */
-    uint32_t ip_dst;                                /**< saved in network order */
-    uint16_t port_src;                              /**< saved in network order */
-    uint16_t port_dst;                              /**< saved in network order */
+#define FLOW_VERSION_9          9
+#define FLOW_VERSION_IPFIX      10
 
-    uint8_t src2dstTos, dst2srcTos;
-    uint8_t src2dstTcpFlags, dst2srcTcpFlags;
-    uint8_t pad1, pad2;
+#define FLOW_V9_TEMPLATE_SET    0           /* set id of a v9 template flowset */
+#define FLOW_IPFIX_TEMPLATE_SET 2           /* set id of an IPFIX template set */
+#define FLOW_TEMPLATE_ID        256         /* IPv4 flows, first non reserved id */
+#define FLOW_TEMPLATE_ID_V6     257         /* IPv6 flows */
 
-    uint64_t bytesSent, pktSent;                    /**< saved in host order */
-    uint64_t bytesRcvd, pktRcvd;                    /**< saved in host order */
-    struct timeval firstSeenRcvd, lastSeenRcvd;     /**< sizeof(timeval) = 16 Bytes */
-    struct timeval firstSeenSent, lastSeenSent;
+struct flow_ver9_hdr {
+  u_int16_t version;         /* Current version=9 */
+  u_int16_t count;           /* Number of records (templates and flows) in PDU */
+  u_int32_t sysUptime;       /* Current time in msecs since router booted */
+  u_int32_t unix_secs;       /* Current seconds since 0000 UTC 1970 */
+  u_int32_t flow_sequence;   /* Sequence number of total PDUs sent */
+  u_int32_t source_id;       /* Exporter observation domain */
+};
 
-  
-    struct rte_table_hashBucket *next;
-} hashBucket_t;
+struct flow_ipfix_hdr {
+  u_int16_t version;         /* Current version=10 */
+  u_int16_t length;          /* Total message length in bytes */
+  u_int32_t export_time;     /* Seconds since 0000 UTC 1970 */
+  u_int32_t flow_sequence;   /* Sequence number of total data records sent */
+  u_int32_t domain_id;       /* Observation domain */
+};
+
+struct flow_set_hdr {
+  u_int16_t set_id;          /* template set id, or the template id of data */
+  u_int16_t length;          /* set length in bytes, header included */
+};
 
-/** Netflow table key format */
+/*
+ * Data record of FLOW_TEMPLATE_ID. The two versions differ in the flow
+ * timestamps: v9 sends sysUptime msecs (FIRST/LAST_SWITCHED), IPFIX
+ * absolute msecs (flowStart/EndMilliseconds). Only IPFIX carries the
+ * layer2SegmentId, v9 has no field type for it. Counters are 64 bit.
+ */
+struct flow_ver9_rec {
+  u_int32_t srcaddr;         /* sourceIPv4Address (8) */
+  u_int32_t dstaddr;         /* destinationIPv4Address (12) */
+  u_int16_t srcport;         /* sourceTransportPort (7) */
+  u_int16_t dstport;         /* destinationTransportPort (11) */
+  u_int8_t  proto;           /* protocolIdentifier (4) */
+  u_int8_t  tos;             /* ipClassOfService (5) */
+  u_int8_t  tcp_flags;       /* tcpControlBits (6) */
+  u_int16_t vlan;            /* vlanId (58) */
+  u_int32_t sampleInt;       /* samplingInterval (34), N */
+  u_int8_t  sampleAlgo;      /* samplingAlgorithm (35) */
+  u_int64_t dOctets;         /* octetDeltaCount (1) */
+  u_int64_t dPkts;           /* packetDeltaCount (2) */
+  u_int32_t first;           /* flowStartSysUpTime (22) */
+  u_int32_t last;            /* flowEndSysUpTime (21) */
+} __attribute__((__packed__));
+
+struct flow_ipfix_rec {
+  u_int32_t srcaddr;
+  u_int32_t dstaddr;
+  u_int16_t srcport;
+  u_int16_t dstport;
+  u_int8_t  proto;
+  u_int8_t  tos;
+  u_int8_t  tcp_flags;
+  u_int16_t vlan;
+  u_int64_t l2seg;           /* layer2SegmentId (351), VXLAN VNI */
+  u_int32_t sampleInt;
+  u_int8_t  sampleAlgo;
+  u_int64_t dOctets;
+  u_int64_t dPkts;
+  u_int64_t first;           /* flowStartMilliseconds (152) */
+  u_int64_t last;            /* flowEndMilliseconds (153) */
+} __attribute__((__packed__));
+
+/* Data records of FLOW_TEMPLATE_ID_V6, the same with IPv6 addresses */
+struct flow_ver9_rec6 {
+  u_int8_t  srcaddr[16];     /* sourceIPv6Address (27) */
+  u_int8_t  dstaddr[16];     /* destinationIPv6Address (28) */
+  u_int16_t srcport;
+  u_int16_t dstport;
+  u_int8_t  proto;
+  u_int8_t  tos;
+  u_int8_t  tcp_flags;
+  u_int16_t vlan;
+  u_int32_t sampleInt;
+  u_int8_t  sampleAlgo;
+  u_int64_t dOctets;
+  u_int64_t dPkts;
+  u_int32_t first;
+  u_int32_t last;
+} __attribute__((__packed__));
+
+struct flow_ipfix_rec6 {
+  u_int8_t  srcaddr[16];
+  u_int8_t  dstaddr[16];
+  u_int16_t srcport;
+  u_int16_t dstport;
+  u_int8_t  proto;
+  u_int8_t  tos;
+  u_int8_t  tcp_flags;
+  u_int16_t vlan;
+  u_int64_t l2seg;
+  u_int32_t sampleInt;
+  u_int8_t  sampleAlgo;
+  u_int64_t dOctets;
+  u_int64_t dPkts;
+  u_int64_t first;
+  u_int64_t last;
+} __attribute__((__packed__));
+
+/** Netflow table key format. IPv6 shards fold each address to 32 bits,
+ * see struct rte_table_netflow_addr6. Flows decapsulated from a tunnel
+ * carry the inner 5-tuple, the tunnel type, and a 16-bit fold of the
+ * tunnel id in place of the VLAN id; the full id is checked on lookup. */
 union rte_table_netflow_key {
     struct {
-        uint8_t pad0;
-        uint8_t vlanId;
-        uint8_t pad1;
+        uint16_t vlanId;                            /**< innermost 802.1Q id, 0 = untagged,
+                                                         or the tunnel id folded, see tunnel */
+        uint8_t tunnel;                             /**< NETFLOW_TUNNEL_* the inner flow came in */
         uint8_t proto;
         uint32_t ip_src;
         uint32_t ip_dst;
@@ -112,16 +214,215 @@ union rte_table_netflow_key {
     __m128i xmm;
 };
 
+typedef struct rte_table_hashBucket {
+    union {
+        struct {                                    /**< same layout as rte_table_netflow_key */
+            uint16_t vlanId;
+            uint8_t tunnel;
+            uint8_t proto;
+
+            uint32_t ip_src;                        /**< saved in network order */
+            uint32_t ip_dst;                        /**< saved in network order */
+            uint16_t port_src;                      /**< saved in network order */
+            uint16_t port_dst;                      /**< saved in network order */
+        };
+        __m128i xmm;                                /**< whole key, for SIMD compare */
+    };
+
+    uint64_t bytesSent, pktSent;                    /**< saved in host order */
+    uint64_t firstSeenSent, lastSeenSent;           /**< TSC of the rx burst, see rte_table_netflow_burst() */
+
+    uint8_t src2dstTos;
+    uint8_t src2dstTcpFlags;
+    uint8_t magic;                                  /**< magic code for validation */
+    uint8_t bucket_expired;                         /**< force bucket to expire */
+    uint32_t dirty_epoch;                           /**< last dirty epoch it was updated in, 0 = none */
+    uint32_t dirty_listed;                          /**< last dirty epoch its pool index was listed in,
+                                                         kept when the bucket is recycled */
+    uint32_t pad3;
+} __rte_cache_aligned hashBucket_t;
+
+/**
+ * Bucket fields the datapath does not touch per packet. They live in a
+ * side array of the shard, at the same index as the bucket in the pool,
+ * so that a packet only dirties the bucket's single cache line. Written by
+ * the owner lcore only, one cache line per bucket.
+ */
+typedef struct rte_table_hashBucket_cold {
+    uint64_t bytesRcvd, pktRcvd;                    /**< saved in host order */
+    uint64_t firstSeenRcvd, lastSeenRcvd;
+    uint8_t dst2srcTos;
+    uint8_t dst2srcTcpFlags;
+    uint16_t mark_slot;                             /**< its MARK slot + 1, 0 = none */
+    uint16_t port;                                  /**< port of the first packet */
+    uint16_t tw_slot;                               /**< level 0 slot, or NETFLOW_TW_SLOTS + level 1 slot */
+    uint32_t hash;                                  /**< key hash, locates the bucket's sets */
+    uint32_t tw_next;                               /**< next bucket in its timing wheel slot */
+    uint32_t tw_prev;                               /**< previous one, NETFLOW_TW_NIL = first */
+    uint32_t tun_id;                                /**< tunnel id, when the key has a tunnel */
+    uint32_t tun_src, tun_dst;                      /**< outer endpoints of the first packet */
+} __rte_cache_aligned hashBucket_cold_t;
+
+/**
+ * Bucket fields written by the exporter, in a side array of their own so
+ * that its stores never land on a line the owner lcore is writing. Reset
+ * when the exporter hands the bucket back, see
+ * rte_table_netflow_bucket_put_bulk().
+ */
+typedef struct rte_table_hashBucket_exp {
+    uint64_t bytesExported, pktExported;            /**< counters already sent */
+    uint64_t bytesSampled;                          /**< bytesSent at the last dirty walk */
+    uint64_t pad;
+} hashBucket_exp_t;
+
+/**
+ * Full addresses of an IPv6 flow, same layout as in struct ipv6_hdr. IPv6
+ * shards key flows on 32-bit folds of the addresses, so the key keeps its
+ * 16 bytes and the whole burst pipeline; a key match is confirmed against
+ * these, kept in a side array like the cold half of the bucket.
+ */
+struct rte_table_netflow_addr6 {
+    uint8_t src[16];
+    uint8_t dst[16];
+};
+
+/** What a packet adds to its flow, filled by the parser along with the key */
+struct rte_table_netflow_pkt {
+    uint16_t l3_len;                                /**< IP header and payload, host order */
+    uint8_t tos;                                    /**< IPv4 ToS or IPv6 traffic class */
+    uint8_t tcp_flags;                              /**< 0 unless TCP */
+    const struct rte_table_netflow_addr6 *addr6;    /**< in the packet, IPv6 only */
+    uint32_t tun_id;                                /**< VNI, GRE key or TEID, key.tunnel set only */
+    uint32_t tun_src, tun_dst;                      /**< outer IPv4 endpoints, network order */
+    uint32_t rss;                                   /**< RSS hash of the key, if has_rss, see packet_rss() */
+    uint8_t has_rss;                                /**< index the table with rss, not f_hash */
+};
+
+/* Hardware flow ids: 24-bit MARK ids of shard, generation and slot */
+#define NETFLOW_MARK_SLOT_BITS      12
+#define NETFLOW_MARK_MAX_SLOTS      (1U << NETFLOW_MARK_SLOT_BITS)  /* per shard */
+#define NETFLOW_MARK_SHARD_SHIFT    20
+#define NETFLOW_MARK_PKTS           4096            /* a flow is checked every this many packets */
+#define NETFLOW_MARK_MIN_AGE        1               /* seconds a flow lives before it gets a rule */
+#define NETFLOW_MARK_SCAN           8               /* slots tried for a free one */
 
-/** Hash function (rte_hash_crc_4bytes) */
+#define NETFLOW_MARK_FREE           0
+#define NETFLOW_MARK_ACTIVE         1               /* rule requested or installed */
+#define NETFLOW_MARK_DYING          2               /* flow gone, rule to remove */
+
+#define NETFLOW_MARK_OP_DEL         (1U << 31)      /* mark_ring request: remove the rule */
+
+/**
+ * A heavy flow handed to the NIC: a rule marks its packets with id, which
+ * leads the datapath straight to bkt. The owner lcore takes FREE slots and
+ * queues them on mark_ring, the controller installs the rule; when the flow
+ * expires the owner queues the slot again and the controller removes the
+ * rule and frees the slot. Stale ids still in the rx rings fail the id
+ * compare, since every use of a slot bumps its generation.
+ */
+struct rte_table_netflow_mark {
+    union rte_table_netflow_key key;                /**< copy for the controller */
+    hashBucket_t *bkt;                              /**< flow the id accounts to, NULL = none */
+    uint32_t id;                                    /**< MARK id */
+    volatile uint8_t state;                         /**< NETFLOW_MARK_*, FREE set by the controller */
+    uint8_t gen;
+    uint16_t port, queue;                           /**< where the flow's packets arrive */
+};
+
+/*
+ * Heavy hitter sketch of a shard, fed every packet whether or not the table
+ * has room for its flow: a count-min sketch of packets, one row per SSE
+ * lane, and the NETFLOW_SKETCH_TOPK keys with the highest estimates. The
+ * owner counts into one bank while the reader merges the other and clears
+ * it, see rte_table_netflow_sketch_close().
+ */
+#define NETFLOW_SKETCH_ROWS     4                   /* count-min rows, one 32-bit lane each */
+#define NETFLOW_SKETCH_COLS     4096                /* counters per row, a power of two */
+#define NETFLOW_SKETCH_TOPK     32                  /* heaviest keys kept per shard and bank */
+#define NETFLOW_SKETCH_SEED     0x5ce7c4            /* of the row hash */
+
+struct rte_table_netflow_topk {
+    union rte_table_netflow_key key;
+    struct rte_table_netflow_addr6 addr6;           /**< IPv6 shards only */
+    uint64_t bytes;                                 /**< bytes seen since the key entered top[] */
+    uint32_t pkts;                                  /**< count-min estimate of its packets */
+} __rte_cache_aligned;
+
+struct rte_table_netflow_sketch_bank {
+    uint32_t cm[NETFLOW_SKETCH_ROWS][NETFLOW_SKETCH_COLS];
+    struct rte_table_netflow_topk top[NETFLOW_SKETCH_TOPK];
+    uint32_t n_top;
+    uint32_t top_min;                               /**< lowest pkts in top[] once full */
+    uint32_t top_min_idx;
+    uint64_t n_pkts;                                /**< packets counted into the bank */
+} __rte_cache_aligned;
+
+struct rte_table_netflow_sketch {
+    volatile uint32_t epoch;                        /**< owner counts into bank[epoch & 1] */
+    volatile uint32_t epoch_req;                    /**< epoch the reader asked for */
+    uint32_t epoch_read;                            /**< epoch whose closed bank the reader took */
+    struct rte_table_netflow_sketch_bank bank[2];
+};
+
+/* Tunnels decapsulated by the parser, key.tunnel */
+#define NETFLOW_TUNNEL_NONE     0
+#define NETFLOW_TUNNEL_VXLAN    1
+#define NETFLOW_TUNNEL_GRE      2
+#define NETFLOW_TUNNEL_GTPU     3
+
+/*
+ * Two level timing wheel of flow deadlines. Level 0 has one slot per tick
+ * (1/64 s) for the next 4 s, level 1 one slot per 256 ticks for the next
+ * 17 minutes; a level 1 slot moves down to level 0 when its turn comes.
+ */
+#define NETFLOW_TW_BITS         8
+#define NETFLOW_TW_SLOTS        (1U << NETFLOW_TW_BITS)
+#define NETFLOW_TW_MASK         (NETFLOW_TW_SLOTS - 1)
+#define NETFLOW_TW_HZ_SHIFT     6                   /* tick = tsc_hz >> 6 cycles */
+#define NETFLOW_TW_NIL          UINT32_MAX          /* end of a slot list */
+
+
+#define NETFLOW_SET_WAYS        6                   /* buckets per set */
+#define NETFLOW_SET_LOAD        4                   /* n_entries per set, keeps sets <= 2/3 full */
+#define NETFLOW_SET_SIG_BITS    ((1U << (2 * NETFLOW_SET_WAYS)) - 1)    /* movemask bits of sig[] */
+
+/**
+ * One cache line of the table. A key hashes to a primary set and, derived
+ * from its signature, an alternative set. A lookup compares the 16-bit
+ * signatures of a whole set with one SSE compare and only dereferences the
+ * buckets whose signature matched. Buckets live in their alternative set
+ * only when the primary set was full, and the primary set counts them in
+ * n_displaced so a miss normally touches a single set.
+ */
+struct rte_table_netflow_set {
+    union {
+        struct {
+            uint16_t sig[NETFLOW_SET_WAYS];         /**< key signature per way, 0 = empty */
+            uint16_t alt_mask;                      /**< ways holding a bucket whose primary set is the other one */
+            uint16_t n_displaced;                   /**< buckets of this set living in their alternative set */
+        };
+        __m128i xmm;
+    };
+    hashBucket_t *bkt[NETFLOW_SET_WAYS];
+} __rte_cache_aligned;
+
+
+/** Hash function over a whole flow key */
 typedef uint32_t (*rte_table_netflow_op_hash)(
-    uint32_t key,
-    uint32_t seed);
+    const union rte_table_netflow_key *key,
+    uint64_t seed);
+
+/** Burst hash function, must agree with its single key counterpart */
+typedef void (*rte_table_netflow_op_hash_bulk)(
+    const union rte_table_netflow_key *keys,
+    uint32_t n_keys,
+    uint64_t seed,
+    uint32_t *hash);
 
 
 /** Netflow table parameters */
 struct rte_table_netflow_params {
-    /** Number of array entries. Has to be a power of two. */
+    /** Number of flows to size the table for. Has to be a power of two. */
     uint32_t n_entries;
 
     /** Byte offset within input */
@@ -130,37 +431,181 @@ struct rte_table_netflow_params {
     /** Hash function */
     rte_table_netflow_op_hash f_hash;
 
+    /** Burst hash function, NULL to call f_hash for every key */
+    rte_table_netflow_op_hash_bulk f_hash_bulk;
+
     /** Seed value for the hash function */
     uint64_t seed;
 
+    /** IPv6 shard: keep and compare the full addresses of every flow */
+    int ipv6;
+
 };
 
+/**
+ * One flow table shard. A shard is written by exactly one datapath lcore and
+ * takes no locks: new buckets are published with a write barrier, so the
+ * exporter may walk the sets concurrently, and buckets removed by
+ * rte_table_netflow_expire() are handed to the exporter on export_ring
+ * instead of being freed. The exporter is the only thread that frees them,
+ * after it is done reading the shard.
+ */
 struct rte_table_netflow {
     /* Input parameters */
     uint32_t entry_size;
     uint32_t n_entries;
 
     rte_table_netflow_op_hash f_hash;
+    rte_table_netflow_op_hash_bulk f_hash_bulk;
     uint64_t seed;
 
-    /* Spinlock for entry */
-    rte_spinlock_t lock[MAX_ENTRY];
+    uint32_t n_sets;
+    uint32_t set_mask;
+
+    /* Time: flow timestamps are raw TSC, converted to wall clock on export */
+    uint64_t now;                                   /**< TSC of the burst being classified */
+    uint64_t idle_ticks;                            /**< IDLE_TIMEOUT in TSC ticks */
+    uint64_t lifetime_ticks;                        /**< LIFETIME_TIMEOUT in TSC ticks */
+
+    /* Expired buckets, single producer (owner lcore) single consumer (exporter) */
+    struct rte_ring *export_ring;
+
+    /* Timing wheel, owner lcore only: lists of pool indexes per slot */
+    uint64_t tw_tick;                               /**< TSC cycles per wheel tick */
+    uint64_t tw_now;                                /**< tick being expired */
+    uint32_t tw_cascade;                            /**< level 1 slot on its way down */
+    uint32_t tw_l0[NETFLOW_TW_SLOTS];
+    uint32_t tw_l1[NETFLOW_TW_SLOTS];
+
+    /*
+     * Dirty tracking: the owner lcore lists every bucket the first time it
+     * is updated in an epoch, in dirty[epoch & 1]. The exporter bumps
+     * epoch_req, the owner switches lists at its next expire call, and the
+     * exporter walks the list of the epoch that closed.
+     */
+    uint32_t *dirty[2];                             /**< pool indexes, n_entries each */
+    uint32_t n_dirty[2];
+    volatile uint32_t epoch;                        /**< epoch the owner records into */
+    volatile uint32_t epoch_req;                    /**< epoch the exporter asked for */
+    uint32_t export_epoch;                          /**< next epoch the exporter walks */
+    uint64_t n_dirty_overflow;                      /**< updates not listed, list full */
+
+    /* Bucket pool: n_entries buckets preallocated on the shard's socket */
+    hashBucket_t *pool;
+    hashBucket_cold_t *cold;                        /**< cold half of pool[i] is cold[i] */
+    hashBucket_exp_t *exp;                          /**< exporter's fields of pool[i] */
+    struct rte_table_netflow_addr6 *addr6;          /**< addresses of pool[i], IPv6 shards only */
+    hashBucket_t **free_bkts;                       /**< stack of free buckets, owner lcore only */
+    uint32_t n_free;
+    struct rte_ring *return_ring;                   /**< exported buckets back from the exporter */
+    uint64_t n_alloc_fail;                          /**< new flows dropped, pool empty */
+
+    /* Statistics, written by the owner lcore only */
+    uint64_t n_pkts;
+    uint64_t n_flows;
+    uint64_t n_expired;
+    uint64_t n_displaced;                           /**< buckets placed in their alternative set */
+    uint64_t n_add_fail;                            /**< new flows dropped, both sets full */
+    uint64_t n_unsampled;                           /**< packets of the lcore left out by sampling, IPv4 shard */
+    uint64_t n_evicted;                             /**< flows exported early to make room */
+
+    /* Eviction, owner lcore only */
+    uint32_t evict_reserve;                         /**< free buckets the sweep keeps */
+    uint32_t evict_hand;                            /**< next set the sweep looks at */
+    uint64_t evict_min_idle;                        /**< EVICT_MIN_IDLE_MS in TSC ticks */
+
+    /* MARK rules for heavy flows, see rte_table_netflow_mark_enable() */
+    struct rte_table_netflow_mark *marks;           /**< n_marks slots, NULL = disabled */
+    uint32_t n_marks;
+    uint32_t mark_next;                             /**< next slot tried */
+    uint32_t mark_base;                             /**< shard bits of the ids */
+    uint64_t mark_min_age;                          /**< NETFLOW_MARK_MIN_AGE in TSC ticks */
+    struct rte_ring *mark_ring;                     /**< slot [| NETFLOW_MARK_OP_DEL], to the controller */
+    uint16_t rx_port, rx_queue;                     /**< where the burst being classified came from */
+    uint64_t n_mark_pkts;                           /**< packets accounted by their MARK */
+    uint64_t n_mark_full;                           /**< heavy flows left in software, no free slot */
+
+    /* Heavy hitters, see rte_table_netflow_sketch_enable() */
+    struct rte_table_netflow_sketch *sketch;        /**< NULL = disabled */
 
     /* Internal table */
-    hashBucket_t *array[0] __rte_cache_aligned;
+    struct rte_table_netflow_set sets[0] __rte_cache_aligned;
 } __rte_cache_aligned;
 
 
 /** Netflow table operations */
 //extern struct rte_table_ops rte_table_netflow_ops;
 
+/** Hash functions for rte_table_netflow_params */
+uint32_t rte_table_netflow_hash_crc32(const union rte_table_netflow_key *, uint64_t);
+uint32_t rte_table_netflow_hash_mulshift(const union rte_table_netflow_key *, uint64_t);
+uint32_t rte_table_netflow_hash_vec(const union rte_table_netflow_key *, uint64_t);
+void rte_table_netflow_hash_vec_bulk(const union rte_table_netflow_key *, uint32_t, uint64_t, uint32_t *);
+
 void *rte_table_netflow_create(void *, int, uint32_t);
 int rte_table_netflow_entry_add(void *, void *, void *);
+int rte_table_netflow_entry_add_bulk(void *, union rte_table_netflow_key *,
+        struct rte_table_netflow_pkt *, uint32_t);
+uint32_t rte_table_netflow_expire(void *);
+int rte_table_netflow_mark_enable(void *, uint32_t, uint32_t, int);
+int rte_table_netflow_mark_account(void *, uint32_t, const uint8_t *, uint32_t);
+int rte_table_netflow_sketch_enable(void *, int);
+const struct rte_table_netflow_sketch_bank *rte_table_netflow_sketch_close(void *);
+void rte_table_netflow_sketch_release(void *);
+uint32_t rte_table_netflow_sketch_estimate(const struct rte_table_netflow_sketch_bank *,
+        const union rte_table_netflow_key *);
+void rte_table_netflow_bucket_put_bulk(void *, hashBucket_t **, unsigned int);
+
+typedef void (*rte_table_netflow_op_dirty)(struct rte_table_netflow *, hashBucket_t *, void *);
+int rte_table_netflow_dirty_walk(void *, rte_table_netflow_op_dirty, void *);
+
+/** Start classifying a new rx burst: one TSC read stamps all its packets */
+static inline void
+rte_table_netflow_burst(struct rte_table_netflow *t)
+{
+    t->now = rte_rdtsc();
+}
+
+static inline hashBucket_cold_t *
+rte_table_netflow_cold(struct rte_table_netflow *t, const hashBucket_t *bkt)
+{
+    return &t->cold[bkt - t->pool];
+}
+
+static inline hashBucket_exp_t *
+rte_table_netflow_exp(struct rte_table_netflow *t, const hashBucket_t *bkt)
+{
+    return &t->exp[bkt - t->pool];
+}
+
+static inline struct rte_table_netflow_addr6 *
+rte_table_netflow_addr6(struct rte_table_netflow *t, const hashBucket_t *bkt)
+{
+    return &t->addr6[bkt - t->pool];
+}
 int rte_table_netflow_free(void *);
 int rte_table_print(void *);
-void rte_table_print_packet_count (void);
-int rte_table_print_stats(void *);
-void rte_table_export_to_file (const char *);
+void rte_table_print_packet_count (struct rte_table_netflow **, unsigned int);
+int rte_table_print_stats(struct rte_table_netflow **, unsigned int);
+
+/* Memory-mapped binary snapshot writer, owned by the export lcore */
+struct rte_table_netflow_snapshot {
+    int fd;
+    size_t size;
+    struct netflow_snap_hdr *hdr;                   /**< mapped file */
+    struct netflow_snap_rec *recs;                  /**< records, right after hdr */
+    uint64_t base[];                                /**< first record of each shard */
+};
+
+struct rte_table_netflow_snapshot *rte_table_snapshot_create(const char *,
+        struct rte_table_netflow **, unsigned int);
+void rte_table_snapshot_begin(struct rte_table_netflow_snapshot *);
+void rte_table_snapshot_end(struct rte_table_netflow_snapshot *);
+void rte_table_snapshot_update(struct rte_table_netflow_snapshot *, unsigned int,
+        struct rte_table_netflow *, const hashBucket_t *);
+void rte_table_snapshot_clear(struct rte_table_netflow_snapshot *, unsigned int,
+        struct rte_table_netflow *, const hashBucket_t *);
+void rte_table_snapshot_free(struct rte_table_netflow_snapshot *);
 
 #ifdef __cplusplus
 }
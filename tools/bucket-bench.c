@@ -0,0 +1,182 @@
+/*
+ * netflow-bucket-bench: per-packet bucket updates with the flow record
+ * layout of the first probe (one 128-byte hashBucket_t, timeval stamps)
+ * against the current one (64-byte hot hashBucket_t, cold fields in a side
+ * array the datapath does not touch). Flows are picked at random from a
+ * pool larger than the last level cache, so the cost is the cache lines
+ * each update dirties.
+ *
+ *   netflow-bucket-bench [FLOWS [UPDATES]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <rte_cycles.h>
+#include <rte_prefetch.h>
+
+#include "rte_table_netflow.h"
+
+#define BENCH_BURST     32                  /* updates per timestamp, as per rx burst */
+#define BENCH_PREFETCH  16                  /* updates the bucket is prefetched ahead */
+
+/* hashBucket_t as the first probe had it */
+struct old_bucket {
+    uint8_t magic;
+    uint8_t bucket_expired;
+    uint8_t vlanId;
+    uint8_t proto;
+
+    uint32_t ip_src;
+    uint32_t ip_dst;
+    uint16_t port_src;
+    uint16_t port_dst;
+
+    uint8_t src2dstTos, dst2srcTos;
+    uint8_t src2dstTcpFlags, dst2srcTcpFlags;
+    uint8_t pad1, pad2;
+
+    uint64_t bytesSent, pktSent;
+    uint64_t bytesRcvd, pktRcvd;
+    struct timeval firstSeenRcvd, lastSeenRcvd;
+    struct timeval firstSeenSent, lastSeenSent;
+
+    struct old_bucket *next;
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+report(const char *name, size_t rec_size, uint64_t n, uint64_t ns, uint64_t cycles)
+{
+    printf("%-8s %4zu bytes/flow  %8.2f Mupdates/s  %6.1f cycles/update\n",
+            name, rec_size, (double)n * 1e3 / ns, (double)cycles / n);
+}
+
+static void
+bench_old(uint32_t n_flows, const uint32_t *idx, const uint16_t *len, uint64_t n)
+{
+    struct old_bucket *pool;
+    struct timeval tv = { 0, 0 };
+    uint64_t i, ns, tsc;
+
+    pool = aligned_alloc(RTE_CACHE_LINE_SIZE, (size_t)n_flows * sizeof(*pool));
+    if (pool == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(pool, 0, (size_t)n_flows * sizeof(*pool));
+
+    ns = now_ns();
+    tsc = rte_rdtsc();
+    for (i = 0; i < n; i++) {
+        struct old_bucket *b = &pool[idx[i]];
+
+        if (i + BENCH_PREFETCH < n) {
+            /* the record spans two lines, both are written */
+            rte_prefetch0(&pool[idx[i + BENCH_PREFETCH]]);
+            rte_prefetch0((char *)&pool[idx[i + BENCH_PREFETCH]] + RTE_CACHE_LINE_SIZE);
+        }
+        if (i % BENCH_BURST == 0)
+            tv.tv_usec++;
+        b->bytesSent += len[i & 1023];
+        b->pktSent++;
+        b->src2dstTcpFlags |= len[i & 1023] & 0x3f;
+        b->lastSeenSent = tv;
+    }
+    tsc = rte_rdtsc() - tsc;
+    ns = now_ns() - ns;
+    report("before", sizeof(*pool), n, ns, tsc);
+    free(pool);
+}
+
+static void
+bench_new(uint32_t n_flows, const uint32_t *idx, const uint16_t *len, uint64_t n)
+{
+    hashBucket_t *pool;
+    hashBucket_cold_t *cold;
+    uint64_t i, ns, tsc, now = 0;
+
+    pool = aligned_alloc(RTE_CACHE_LINE_SIZE, (size_t)n_flows * sizeof(*pool));
+    cold = aligned_alloc(RTE_CACHE_LINE_SIZE, (size_t)n_flows * sizeof(*cold));
+    if (pool == NULL || cold == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(pool, 0, (size_t)n_flows * sizeof(*pool));
+    memset(cold, 0, (size_t)n_flows * sizeof(*cold));
+
+    ns = now_ns();
+    tsc = rte_rdtsc();
+    for (i = 0; i < n; i++) {
+        hashBucket_t *b = &pool[idx[i]];
+
+        if (i + BENCH_PREFETCH < n)
+            rte_prefetch0(&pool[idx[i + BENCH_PREFETCH]]);
+        if (i % BENCH_BURST == 0)
+            now++;
+        b->bytesSent += len[i & 1023];
+        b->pktSent++;
+        b->src2dstTcpFlags |= len[i & 1023] & 0x3f;
+        b->lastSeenSent = now;
+    }
+    tsc = rte_rdtsc() - tsc;
+    ns = now_ns() - ns;
+    report("after", sizeof(*pool) + sizeof(*cold) + sizeof(hashBucket_exp_t), n, ns, tsc);
+    free(cold);
+    free(pool);
+}
+
+int
+main(int argc, char **argv)
+{
+    uint32_t n_flows = 1 << 20;
+    uint64_t n = 32 << 20, i, x = 88172645463325252ULL;
+    uint32_t *idx;
+    uint16_t len[1024];
+
+    if (argc > 3) {
+        fprintf(stderr, "usage: %s [FLOWS [UPDATES]]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 1)
+        n_flows = strtoul(argv[1], NULL, 0);
+    if (argc > 2)
+        n = strtoull(argv[2], NULL, 0);
+    if (n_flows == 0 || n == 0) {
+        fprintf(stderr, "FLOWS and UPDATES must be > 0\n");
+        return 1;
+    }
+
+    /* the same flow and packet length sequence for both layouts */
+    idx = malloc(n * sizeof(*idx));
+    if (idx == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        idx[i] = x % n_flows;
+    }
+    for (i = 0; i < 1024; i++)
+        len[i] = 64 + (idx[i % n] & 1023) + (i & 1) * 400;
+
+    printf("%u flows, %lu updates\n", n_flows, (unsigned long)n);
+    bench_old(n_flows, idx, len, n);
+    bench_new(n_flows, idx, len, n);
+
+    free(idx);
+    return 0;
+}
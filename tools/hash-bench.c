@@ -0,0 +1,235 @@
+/*
+ * netflow-hash-bench: cost and spread of the flow table hash functions.
+ * Hashes a key set with each of them and reports cycles per key and how
+ * many keys land in each set of a table sized for the keys; sets with more
+ * keys than ways push the excess to alternative sets. The keys come from a
+ * flow snapshot of the probe, or are made up: clients of a few /16s talking
+ * to a few servers on common ports.
+ *
+ *   netflow-hash-bench [-n KEYS] [-s SEED] [SNAPSHOT]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <rte_common.h>
+#include <rte_cycles.h>
+#include <rte_hash_crc.h>
+
+#include "rte_table_netflow.h"
+#include "netflow-snapshot.h"
+
+#define BENCH_MIN_HASHES    (64 << 20)      /* keys hashed per timing, repeating the set */
+
+struct bench_hash {
+    const char *name;
+    rte_table_netflow_op_hash f_hash;
+    rte_table_netflow_op_hash_bulk f_hash_bulk;
+};
+
+static const struct bench_hash hashes[] = {
+    { "crc32",    rte_table_netflow_hash_crc32,    NULL },
+    { "mulshift", rte_table_netflow_hash_mulshift, NULL },
+    { "vec",      rte_table_netflow_hash_vec,      NULL },
+    { "vec-bulk", rte_table_netflow_hash_vec,      rte_table_netflow_hash_vec_bulk },
+};
+
+static uint64_t rnd = 88172645463325252ULL;
+
+static uint32_t
+bench_rand(void)
+{
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 7;
+    rnd ^= rnd << 17;
+    return rnd >> 32;
+}
+
+static void
+keys_synthetic(union rte_table_netflow_key *keys, uint32_t n)
+{
+    static const uint16_t svc[] = { 443, 80, 53, 123, 22, 8080, 993, 3478 };
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        memset(&keys[i], 0, sizeof(keys[i]));
+        keys[i].ip_src = htonl(0x0a000000 | (bench_rand() % 4) << 16 | (bench_rand() & 0xffff));
+        keys[i].ip_dst = htonl(0xc6336400 | (bench_rand() % 64));
+        keys[i].port_src = htons(32768 + bench_rand() % 28232);
+        keys[i].port_dst = htons(svc[bench_rand() % RTE_DIM(svc)]);
+        keys[i].proto = keys[i].port_dst == htons(53) || keys[i].port_dst == htons(123) ||
+            keys[i].port_dst == htons(3478) ? IPPROTO_UDP : IPPROTO_TCP;
+    }
+}
+
+/* As the probe folds IPv6 addresses into the key, see parse_ipv6() */
+static uint32_t
+fold_ipv6(const uint8_t *addr)
+{
+    uint64_t w[2];
+
+    memcpy(w, addr, sizeof(w));
+    return rte_hash_crc_8byte(w[1], rte_hash_crc_8byte(w[0], 0));
+}
+
+/* Keys of the flows in a snapshot */
+static union rte_table_netflow_key *
+keys_snapshot(const char *path, uint32_t *n_keys)
+{
+    struct netflow_snap snap;
+    struct netflow_snap_hdr hdr;
+    struct netflow_snap_rec *recs;
+    union rte_table_netflow_key *keys;
+    uint32_t n = 0;
+    long i, n_recs;
+    int ret;
+
+    ret = netflow_snap_open(&snap, path);
+    if (ret < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(-ret));
+        return NULL;
+    }
+    recs = malloc(snap.hdr->capacity * sizeof(*recs) + 1);
+    keys = aligned_alloc(sizeof(__m128i), (snap.hdr->capacity + 1) * sizeof(*keys));
+    if (recs == NULL || keys == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return NULL;
+    }
+    n_recs = netflow_snap_read(&snap, &hdr, recs, snap.hdr->capacity);
+    if (n_recs < 0) {
+        fprintf(stderr, "%s: no stable snapshot, writer too busy\n", path);
+        return NULL;
+    }
+
+    for (i = 0; i < n_recs; i++) {
+        if (recs[i].pkts == 0)
+            continue;
+        memset(&keys[n], 0, sizeof(keys[n]));
+        keys[n].vlanId = recs[i].vlan;
+        keys[n].tunnel = recs[i].tunnel;
+        keys[n].proto = recs[i].proto;
+        keys[n].port_src = recs[i].port_src;
+        keys[n].port_dst = recs[i].port_dst;
+        if (recs[i].family == 6) {
+            keys[n].ip_src = fold_ipv6(recs[i].ip6_src);
+            keys[n].ip_dst = fold_ipv6(recs[i].ip6_dst);
+        } else {
+            keys[n].ip_src = recs[i].ip_src;
+            keys[n].ip_dst = recs[i].ip_dst;
+        }
+        n++;
+    }
+
+    free(recs);
+    netflow_snap_close(&snap);
+    *n_keys = n;
+    return keys;
+}
+
+static void
+bench(const struct bench_hash *h, const union rte_table_netflow_key *keys, uint32_t n_keys,
+        uint64_t seed, uint32_t *hash, uint32_t *fill, uint32_t n_sets)
+{
+    uint32_t hist[NETFLOW_SET_WAYS + 2] = { 0 };
+    uint64_t tsc, n = 0, spill = 0;
+    uint32_t i, j;
+
+    /* cycles per key, the set hashed again until the timing is long enough */
+    tsc = rte_rdtsc();
+    while (n < BENCH_MIN_HASHES) {
+        if (h->f_hash_bulk != NULL) {
+            for (i = 0; i < n_keys; i += NETFLOW_BULK_MAX)
+                h->f_hash_bulk(&keys[i], RTE_MIN(n_keys - i, (uint32_t)NETFLOW_BULK_MAX),
+                        seed, &hash[i]);
+        } else {
+            for (i = 0; i < n_keys; i++)
+                hash[i] = h->f_hash(&keys[i], seed);
+        }
+        n += n_keys;
+    }
+    tsc = rte_rdtsc() - tsc;
+
+    /* keys per set, as the table takes the set from the low bits */
+    memset(fill, 0, n_sets * sizeof(*fill));
+    for (i = 0; i < n_keys; i++)
+        fill[hash[i] & (n_sets - 1)]++;
+    for (i = 0; i < n_sets; i++) {
+        hist[RTE_MIN(fill[i], (uint32_t)NETFLOW_SET_WAYS + 1)]++;
+        if (fill[i] > NETFLOW_SET_WAYS)
+            spill += fill[i] - NETFLOW_SET_WAYS;
+    }
+
+    printf("%-9s %10.2f ", h->name, (double)tsc / n);
+    for (j = 0; j <= NETFLOW_SET_WAYS + 1; j++)
+        printf(" %6.2f", 100.0 * hist[j] / n_sets);
+    printf("  %6.3f%%\n", 100.0 * spill / n_keys);
+}
+
+int
+main(int argc, char **argv)
+{
+    union rte_table_netflow_key *keys;
+    uint32_t n_keys = 1 << 20, n_sets, *hash, *fill, i;
+    uint64_t seed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n_keys = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n KEYS] [-s SEED] [SNAPSHOT]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        keys = keys_snapshot(argv[optind], &n_keys);
+        if (keys == NULL)
+            return 1;
+    } else {
+        keys = aligned_alloc(sizeof(__m128i), ((size_t)n_keys + 1) * sizeof(*keys));
+        if (keys == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        keys_synthetic(keys, n_keys);
+    }
+    if (n_keys == 0) {
+        fprintf(stderr, "no keys\n");
+        return 1;
+    }
+
+    /* the sets of a table sized for the keys, see rte_table_netflow_create() */
+    n_sets = rte_align32pow2(n_keys) / NETFLOW_SET_LOAD;
+    if (n_sets == 0)
+        n_sets = 1;
+    hash = malloc((size_t)n_keys * sizeof(*hash));
+    fill = malloc((size_t)n_sets * sizeof(*fill));
+    if (hash == NULL || fill == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    printf("%u keys, %u sets of %u ways: %% of the sets holding N keys, %% of the keys\n"
+            "past the ways of their set\n\n", n_keys, n_sets, NETFLOW_SET_WAYS);
+    printf("%-9s %10s ", "hash", "cycles/key");
+    for (i = 0; i <= NETFLOW_SET_WAYS; i++)
+        printf(" %6u", i);
+    printf(" %5u+  spilled\n", NETFLOW_SET_WAYS + 1);
+    for (i = 0; i < RTE_DIM(hashes); i++)
+        bench(&hashes[i], keys, n_keys, seed, hash, fill, n_sets);
+
+    free(fill);
+    free(hash);
+    free(keys);
+    return 0;
+}